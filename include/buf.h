@@ -4,8 +4,14 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 #include <wchar.h>
 
+#include "hist_file.h"
+#include "journal.h"
+#include "line_idx.h"
+#include "mark.h"
+#include "piece.h"
 #include "util.h"
 
 enum buf_src_type
@@ -14,11 +20,37 @@ enum buf_src_type
 	BST_FILE,
 };
 
+enum buf_store
+{
+	BS_GAP = 0,
+	BS_PIECE,
+};
+
 enum buf_flag
 {
 	BF_WRITABLE = 0x1,
 	BF_MODIFIED = 0x2,
 	BF_NO_HIST = 0x4,
+	BF_SAVING = 0x8,
+	BF_LOADING = 0x10,
+	BF_LAZY = 0x20,
+	BF_NO_JOURNAL = 0x40,
+};
+
+// what to do with the parts of a changed file which conflict with unsaved
+// edits, see `buf_merge()`.
+enum buf_merge_mode
+{
+	BMM_NONE = 0,
+	BMM_KEEP_BUF,
+	BMM_TAKE_FILE,
+};
+
+enum buf_merge_status
+{
+	BMS_OK = 0,
+	BMS_FAIL,
+	BMS_CONFLICT,
 };
 
 enum buf_op_type
@@ -28,33 +60,162 @@ enum buf_op_type
 	BOT_BRK,
 };
 
+// undo payloads are carved out of shared chunks, each of which is freed once
+// nothing points into it anymore.
+struct hist_chunk
+{
+	size_t used, cap;
+	size_t nlive;
+	wchar_t data[];
+};
+
 struct buf_op
 {
 	wchar_t *data;
+	struct hist_chunk *chunk;
 	size_t lb, ub;
 	unsigned char type;
 };
 
-VEC_DEF_PROTO(struct buf_op, buf_op)
+struct buf_hist
+{
+	// operations are kept in a ring, with the oldest one at `first`.
+	// those before `cur` have been applied, those from `cur` onward have
+	// been undone and can still be redone.
+	struct buf_op *ops;
+	size_t cap, first, size, cur;
+	
+	// approximate memory held by the history, kept under
+	// `CONF_HIST_BUDGET` by dropping the oldest operations.
+	size_t nbytes;
+	struct hist_chunk *top;
+	
+	// set after an undo or redo so that the next edit is not merged into
+	// an earlier operation.
+	bool sealed;
+	
+	// history saved by earlier sessions, which is read back once all of
+	// the operations before it have been undone.
+	struct hist_file file;
+};
+
+struct buf_save_job;
+struct buf_load_job;
+struct buf_share;
+
+// describes a single edit, after which `nrm` characters starting at `off` have
+// been replaced by `nins` new ones.
+// `ver` is the version of the buffer right after the edit.
+struct buf_delta
+{
+	size_t off, nrm, nins;
+	uint64_t ver;
+};
+
+struct buf_listener
+{
+	void (*fn)(struct buf_delta const *, void *);
+	void *ctx;
+};
+
+VEC_DEF_PROTO(struct buf_listener, buf_listener)
+
+// a run of `len` characters stored contiguously in a buffer, each `width`
+// bytes wide, which can be read in place with `buf_span_get()`.
+// only valid until the buffer is next edited.
+struct buf_span
+{
+	void const *data;
+	unsigned char width;
+	size_t len;
+};
 
 struct buf
 {
-	// TODO: change name back and implement gap buffer system.
-	// name suffixed with `_` to raise errors where it was previously used,
-	// so that they can be changed.
-	wchar_t *conts_;
+	// contents are stored as a gap buffer, with the gap sitting at the
+	// location of the most recent edit.
+	// never index into this directly, use `buf_get_wch()` and friends.
+	// unused while `store` is `BS_PIECE`, in which case `pt` holds the
+	// contents instead.
+	// each character takes up `width` bytes, which is 1, 2 or 4, and is
+	// only ever increased as wider characters are written.
+	void *conts;
+	unsigned char width;
+	struct piece_tab pt;
+	unsigned char store;
 	
 	// `size` ignores the size of the internal gap.
 	// e.g. a five-wchar gap with two wchars around it would yield a buffer
 	// size of 2.
 	size_t size;
 	
+	// `cap` includes the gap, so `size + gap_size == cap` always holds.
 	size_t cap;
 	size_t gap_pos, gap_size;
+	
+	// kept up to date on every edit, so that position and line lookups
+	// don't need to scan the contents.
+	struct line_idx lines;
+	
+	// positions that need to stay attached to the same text as it is
+	// edited around them.
+	struct mark_tree marks;
+	
 	void *src;
 	unsigned char src_type;
+	
+	// what the source file looked like when it was last read or written,
+	// so that changes made to it by other programs can be noticed.
+	struct timespec src_mtime;
+	size_t src_size;
+	
+	// hashes of the lines of the source file as it was last read, written
+	// or merged, against which unsaved edits are told apart from changes
+	// made to the file by other programs.
+	// not kept for mapped contents, which are never merged.
+	uint64_t *base_lines;
+	size_t nbase_lines;
+	
+	// inotify watch on the directory holding the source file, or -1.
+	int watch;
+	
+	// records edits made since the source file was last read or written,
+	// opened on the first such edit.
+	struct journal *journal;
+	
 	uint8_t flags;
-	struct vec_buf_op hist;
+	struct buf_hist hist;
+	
+	// set while a save is being written out in the background.
+	struct buf_save_job *save_job;
+	
+	// set while the rest of a file is being loaded in the background, in
+	// which case the buffer only holds the start of the file and cannot
+	// be edited.
+	struct buf_load_job *load_job;
+	
+	// set while gap buffer contents are shared with snapshots, in which
+	// case they are copied before the next edit.
+	// in a snapshot, this is its reference to the shared contents.
+	struct buf_share *share;
+	
+	// hash and length of the contents as they were last read or saved, which
+	// the current contents are checked against on every edit, so that undoing
+	// all changes leaves the buffer unmodified again.
+	uint64_t saved_hash;
+	size_t saved_len;
+	
+	// while inside `buf_txn_begin()` and `buf_txn_end()`, writes which
+	// extend the previous one are collected in `txn_ins` instead of being
+	// applied, and are then inserted at `txn_pos` all at once.
+	unsigned txn_depth;
+	wchar_t *txn_ins;
+	size_t txn_len, txn_cap, txn_pos;
+	
+	// incremented on every edit, and never reused for the lifetime of the
+	// buffer.
+	uint64_t ver;
+	struct vec_buf_listener listeners;
 };
 
 VEC_DEF_PROTO(struct buf *, p_buf)
@@ -62,15 +223,43 @@ VEC_DEF_PROTO(struct buf *, p_buf)
 struct buf buf_create(bool writable);
 struct buf buf_from_file(char const *path);
 struct buf buf_from_wstr(wchar_t const *wstr, bool writable);
+struct buf buf_from_file_lazy(char const *path);
+void buf_materialize(struct buf *b);
+bool buf_src_changed(struct buf const *b);
+void buf_note_src(struct buf *b);
+enum buf_merge_status buf_merge(struct buf *b, enum buf_merge_mode mode);
 int buf_save(struct buf *b);
+unsigned buf_load_pct(struct buf const *b);
+int buf_wake_fd(void);
+int buf_reap_save(struct buf *b, bool wait);
+void buf_reap_load(struct buf *b, bool wait);
 int buf_undo(struct buf *b);
+int buf_redo(struct buf *b);
+struct buf_op const *buf_peek_undo(struct buf *b);
+struct buf_op const *buf_peek_redo(struct buf const *b);
 void buf_destroy(struct buf *b);
+void buf_snap(struct buf *b, struct buf *out);
+void buf_snap_destroy(struct buf *snap);
 void buf_write_wch(struct buf *b, size_t ind, wchar_t wch);
 void buf_write_wstr(struct buf *b, size_t ind, wchar_t const *wstr);
 void buf_erase(struct buf *b, size_t lb, size_t ub);
 void buf_push_hist_brk(struct buf *b);
+void buf_txn_begin(struct buf *b);
+void buf_txn_end(struct buf *b);
+void buf_listen(struct buf *b, void (*fn)(struct buf_delta const *, void *), void *ctx);
+void buf_unlisten(struct buf *b, void (*fn)(struct buf_delta const *, void *), void *ctx);
 void buf_pos(struct buf const *b, size_t pos, unsigned *out_r, unsigned *out_c);
+size_t buf_line_start(struct buf const *b, size_t ln);
+size_t buf_line_end(struct buf const *b, size_t ln);
+size_t buf_line_cnt(struct buf const *b);
+size_t buf_mark_add(struct buf *b, size_t pos);
+void buf_mark_rm(struct buf *b, size_t mark);
+size_t buf_mark_get(struct buf const *b, size_t mark);
+void buf_mark_put(struct buf *b, size_t mark, size_t pos);
 wchar_t buf_get_wch(struct buf const *b, size_t ind);
 wchar_t *buf_get_wstr(struct buf const *b, wchar_t *dst, size_t ind, size_t n);
+size_t buf_span_at(struct buf const *b, size_t ind, struct buf_span *out);
+wchar_t buf_span_get(struct buf_span const *s, size_t i);
+bool buf_match_at(struct buf const *b, size_t ind, wchar_t const *lit);
 
 #endif
@@ -15,6 +15,68 @@
 #define CONF_MNUM 4
 #define CONF_MDENOM 7
 
+// buffer storage options.
+// files at least this large are mapped and edited through a piece table rather
+// than being read into memory.
+#define CONF_PIECE_THRESHOLD (64 * 1024 * 1024)
+
+// smaller files are read and decoded in blocks of this many bytes.
+#define CONF_LOAD_BLK_SIZE (1024 * 1024)
+
+// files larger than this are loaded in the background, with only this many
+// bytes decoded before the buffer is first shown.
+#define CONF_LOAD_HEAD_SIZE (256 * 1024)
+
+// while any file is loading in the background, the screen is redrawn at least
+// once per this many milliseconds to show how far along it is.
+#define CONF_LOAD_PROGRESS_INTERVAL 250
+
+// buffers are encoded for saving in blocks of this many characters.
+#define CONF_SAVE_BLK_SIZE (256 * 1024)
+
+// undo history is trimmed from the oldest end once it holds more than this
+// many bytes.
+#define CONF_HIST_BUDGET (16 * 1024 * 1024)
+
+// edits only count as modifying a buffer if its text ends up differing from
+// what was last read or saved, which is checked by rehashing the changed parts
+// of the text, unless there are more than this many characters of them.
+#define CONF_MOD_REHASH_MAX (1024 * 1024)
+
+// files changed on disk are reloaded by editing only the lines that differ,
+// unless more than this many lines need to be added or removed.
+#define CONF_RELOAD_MAX_DIFF 1024
+
+// edits to files are journaled next to them until saved, so that they can be
+// recovered after a crash.
+// the journal is written out and synced at most once per this many
+// milliseconds.
+#define CONF_JOURNAL_INTERVAL 1000
+#define CONF_JOURNAL_SUFFIX ".medioed-journal"
+
+// undo history can be kept across sessions by writing it out whenever a file is
+// saved, alongside the file or in `CONF_UNDO_DIR` if that is set.
+// this is off by default, as the files written alongside others would clutter
+// every directory edited in.
+// earlier history is read back this many operations at a time once everything
+// from the current session has been undone, and is dropped once it grows past
+// `CONF_UNDO_FILE_BUDGET` bytes.
+#define CONF_UNDO_PERSIST 0
+#define CONF_UNDO_DIR NULL
+#define CONF_UNDO_SUFFIX ".medioed-undo"
+#define CONF_UNDO_LOAD_BATCH 256
+#define CONF_UNDO_FILE_BUDGET (32 * 1024 * 1024)
+
+// while more keys are already waiting to be handled, such as when pasting or
+// holding down a key, redrawing is put off for up to this many milliseconds.
+#define CONF_REDRAW_MAX_DELAY 50
+
+// screen updates are wrapped in synchronized update sequences (DEC private
+// mode 2026), so that terminals which support them never show a half drawn
+// screen.
+// other terminals ignore the sequences.
+#define CONF_SYNC_UPDATE 1
+
 // master color options.
 #define CONF_A_GNORM_FG 183
 #define CONF_A_GNORM_BG 232
@@ -45,6 +107,10 @@
 
 #define CONF_MARK_MOD L"[~*]"
 #define CONF_MARK_MONO L"[M!]"
+#define CONF_MARK_SAVING L"[>>]"
+
+// given how much of the file has been loaded so far, in percent.
+#define CONF_MARK_LOADING L"[<<%u%%]"
 
 // scrap buffer options.
 #define CONF_SCRAP_NAME L"*scrap*"
@@ -131,6 +197,7 @@ extern int const conf_bind_focus[];
 extern int const conf_bind_kill[];
 extern int const conf_bind_paste[];
 extern int const conf_bind_undo[];
+extern int const conf_bind_redo[];
 extern int const conf_bind_copy[];
 extern int const conf_bind_ncopy[];
 extern int const conf_bind_find_lit[];
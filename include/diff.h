@@ -0,0 +1,17 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// replaces `a_len` lines starting at `a_start` in the old text with `b_len`
+// lines starting at `b_start` in the new text.
+struct diff_hunk
+{
+	size_t a_start, a_len;
+	size_t b_start, b_len;
+};
+
+size_t diff_lines(uint64_t const *a, size_t na, uint64_t const *b, size_t nb, size_t max_cost, struct diff_hunk **out);
+
+#endif
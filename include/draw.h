@@ -18,6 +18,8 @@ void draw_put_wch(unsigned r, unsigned c, wchar_t wch);
 void draw_put_wstr(unsigned r, unsigned c, wchar_t const *wstr);
 void draw_put_attr(unsigned r, unsigned c, uint8_t fg, uint8_t bg, unsigned n);
 void draw_refresh(void);
+unsigned long draw_gen(void);
+size_t draw_refresh_bytes(void);
 struct win_size draw_win_size(void);
 
 #endif
@@ -1,11 +1,15 @@
 #ifndef EDITOR_H
 #define EDITOR_H
 
+#include <stddef.h>
+
 int editor_init(int argc, char const *argv[]);
 void editor_main_loop(void);
 void editor_quit(void);
 void editor_redraw(void);
+size_t editor_frames_redrawn(void);
 struct buf *editor_add_buf(struct buf *b);
+void editor_rm_buf(size_t ind);
 struct frame *editor_add_frame(struct frame *f);
 void editor_arrange_frames(void);
 void editor_reset_binds(void);
@@ -30,6 +30,7 @@ void editor_bind_focus(void);
 void editor_bind_kill(void);
 void editor_bind_paste(void);
 void editor_bind_undo(void);
+void editor_bind_redo(void);
 void editor_bind_copy(void);
 void editor_bind_ncopy(void);
 void editor_bind_find_lit(void);
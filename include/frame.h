@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <wchar.h>
 
 #include "buf.h"
@@ -14,6 +15,23 @@ enum frame_draw_flag
 	FDF_MONO = 0x2,
 };
 
+struct frame_layout;
+
+// everything drawing a frame depends on, as it was when it was last drawn.
+struct frame_drawn
+{
+	bool valid;
+	struct buf const *buf;
+	uint64_t buf_ver;
+	uint8_t buf_flags;
+	unsigned load_pct;
+	wchar_t const *name;
+	char const *local_mode;
+	size_t buf_start, csr;
+	unsigned pr, pc, sr, sc;
+	unsigned long flags;
+};
+
 struct frame
 {
 	wchar_t *name;
@@ -22,8 +40,21 @@ struct frame
 	struct buf *buf;
 	char *local_mode;
 	size_t buf_start, csr;
+	
+	// `buf_start` and `csr` are mirrored into marks on the buffer so that
+	// edits made elsewhere keep them in place.
+	// the last synced values tell which side moved since the last sync.
+	size_t start_mark, csr_mark;
+	size_t start_synced, csr_synced;
 	unsigned linum_width;
 	unsigned csr_want_col;
+	
+	// where each visible character goes on screen, worked out once and
+	// then reused until the frame or its buffer change.
+	struct frame_layout *layout;
+	
+	// drawing is skipped while none of this has changed.
+	struct frame_drawn drawn;
 };
 
 VEC_DEF_PROTO(struct frame, frame)
@@ -31,9 +62,12 @@ VEC_DEF_PROTO(struct frame, frame)
 struct frame frame_create(wchar_t const *name, struct buf *buf);
 void frame_destroy(struct frame *f);
 void frame_draw(struct frame const *f, unsigned long flags);
+bool frame_redraw(struct frame *f, unsigned long flags, bool force);
+bool frame_moved(struct frame const *f);
 void frame_pos(struct frame const *f, size_t pos, unsigned *out_r, unsigned *out_c);
 void frame_mv_csr(struct frame *f, unsigned r, unsigned c);
 void frame_mv_csr_rel(struct frame *f, int dr, int dc, bool wrap);
 void frame_comp_boundary(struct frame *f);
+void frame_sync_marks(struct frame *f);
 
 #endif
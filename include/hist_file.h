@@ -0,0 +1,57 @@
+#ifndef HIST_FILE_H
+#define HIST_FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+enum hist_rec_type
+{
+	HRT_WRITE = 0,
+	HRT_ERASE,
+	HRT_BRK,
+	
+	// marks the point at which the text hashed to `key`, so that older
+	// records are only used on top of the text they were made to.
+	HRT_KEY,
+};
+
+// a single record read back from a history file.
+// erased text is left encoded in `bytes`, which points into the mapping.
+struct hist_rec
+{
+	unsigned char type;
+	size_t lb, ub;
+	uint64_t key;
+	uint8_t const *bytes;
+	size_t nbytes;
+};
+
+struct hist_file
+{
+	// the file is mapped rather than read, as usually only its most
+	// recent records are ever needed.
+	uint8_t const *map;
+	size_t len;
+	
+	// records before this offset have not been read yet.
+	size_t end;
+};
+
+struct hist_file_enc
+{
+	uint8_t *bytes;
+	size_t n, cap;
+};
+
+int hist_file_open(char const *src, struct hist_file *out);
+void hist_file_close(struct hist_file *hf);
+int hist_file_peek(struct hist_file const *hf, struct hist_rec *out);
+void hist_file_pop(struct hist_file *hf);
+size_t hist_file_decode(struct hist_rec const *rec, wchar_t *out);
+void hist_file_put(struct hist_file_enc *enc, struct hist_rec const *rec, wchar_t const *rev_data);
+void hist_file_put_raw(struct hist_file_enc *enc, struct hist_file const *hf);
+int hist_file_write(char const *src, struct hist_file_enc const *enc);
+
+#endif
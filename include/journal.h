@@ -0,0 +1,36 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <wchar.h>
+
+enum journal_status
+{
+	JS_OK = 0,
+	JS_NONE,
+	JS_STALE,
+};
+
+struct journal;
+
+// a recorded edit, replacing the text between `lb` and `ub` with `wstr`.
+// writes have `lb == ub`, and erases have no text.
+struct journal_rec
+{
+	size_t lb, ub;
+	wchar_t *wstr;
+};
+
+struct journal *journal_open(char const *src, struct timespec mtime, size_t size);
+void journal_close(struct journal *j);
+void journal_write(struct journal *j, size_t pos, wchar_t const *wstr, size_t len);
+void journal_erase(struct journal *j, size_t lb, size_t ub);
+size_t journal_len(struct journal *j);
+struct journal *journal_rebase(struct journal *j, size_t off, struct timespec mtime, size_t size);
+enum journal_status journal_load(char const *src, struct timespec mtime, size_t size, struct journal_rec **out_recs, size_t *out_nrecs);
+void journal_free_recs(struct journal_rec *recs, size_t nrecs);
+void journal_discard(char const *src);
+
+#endif
@@ -19,6 +19,7 @@ bool keybd_is_rec_mac(void);
 void keybd_rec_mac_end(void);
 void keybd_exec_mac(void);
 bool keybd_is_exec_mac(void);
+bool keybd_key_pending(void);
 wint_t keybd_await_key_nb(void);
 wint_t keybd_await_key(void);
 void keybd_key_dpy(wchar_t *out, int const *kbuf, size_t nk);
@@ -0,0 +1,51 @@
+#ifndef LINE_IDX_H
+#define LINE_IDX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#define LINE_IDX_BLK_CAP 256
+
+struct line_blk
+{
+	// line lengths include the terminating newline, except for the last
+	// line of the text, which has none.
+	size_t lens[LINE_IDX_BLK_CAP];
+	size_t nlines, sum;
+	
+	// hash of the text covered by the block, only valid while `hash_ok`
+	// is set.
+	uint64_t hash;
+	bool hash_ok;
+};
+
+struct line_idx
+{
+	struct line_blk **blks;
+	size_t nblks, blks_cap;
+	
+	// segment tree over the blocks, storing line and character totals.
+	// leaves are located at `tree_cap + n` for block n.
+	size_t *tree_cnt, *tree_sum;
+	size_t tree_cap;
+	
+	// hashes of the text covered by each node of the tree, recomputed
+	// only for nodes above blocks which have changed.
+	uint64_t *tree_hash;
+	bool *tree_hash_ok;
+};
+
+struct line_idx line_idx_create(void);
+void line_idx_destroy(struct line_idx *li);
+void line_idx_insert(struct line_idx *li, size_t pos, size_t const *segs, size_t nsegs);
+void line_idx_insert_wstr(struct line_idx *li, size_t pos, wchar_t const *wstr, size_t len);
+void line_idx_erase(struct line_idx *li, size_t lb, size_t ub);
+void line_idx_pos(struct line_idx const *li, size_t pos, size_t *out_ln, size_t *out_col);
+size_t line_idx_start(struct line_idx const *li, size_t ln);
+size_t line_idx_len(struct line_idx const *li, size_t ln);
+size_t line_idx_cnt(struct line_idx const *li);
+int line_idx_hash(struct line_idx *li, size_t max_rehash, void (*read)(void const *, wchar_t *, size_t, size_t), void const *ctx, uint64_t *out_hash);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef MARK_H
+#define MARK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MARK_NIL SIZE_MAX
+
+struct mark_node
+{
+	size_t pos;
+	size_t l, r, parent;
+	uint32_t prio;
+	
+	// shifts and clamps are applied lazily, and only pushed down to the
+	// children of a node when they need to be looked at.
+	// `add` wraps around, so it can also hold negative shifts.
+	size_t add, set_pos;
+	bool set;
+};
+
+struct mark_tree
+{
+	// nodes are addressed by index, which doubles as the handle given out
+	// for a mark, so it stays valid as long as the mark exists.
+	struct mark_node *nodes;
+	size_t nnodes, cap;
+	size_t root, free;
+};
+
+struct mark_tree mark_tree_create(void);
+void mark_tree_destroy(struct mark_tree *mt);
+size_t mark_tree_add(struct mark_tree *mt, size_t pos);
+void mark_tree_rm(struct mark_tree *mt, size_t mark);
+size_t mark_tree_get(struct mark_tree const *mt, size_t mark);
+void mark_tree_put(struct mark_tree *mt, size_t mark, size_t pos);
+void mark_tree_insert(struct mark_tree *mt, size_t pos, size_t n);
+void mark_tree_erase(struct mark_tree *mt, size_t lb, size_t ub);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef PIECE_H
+#define PIECE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+// characters of the original file are indexed by remembering the byte offset
+// of every `PIECE_CKPT_GAP`th character.
+#define PIECE_CKPT_GAP 4096
+#define PIECE_ADD_CHUNK_SIZE 65536
+
+enum piece_src
+{
+	PS_ORIG = 0,
+	
+	// add chunks are identified by `PS_ADD + n`, where n is the index of
+	// the chunk in `add_chunks`.
+	PS_ADD,
+};
+
+struct piece
+{
+	size_t off, len;
+	uint32_t src;
+};
+
+struct piece_chunk
+{
+	wchar_t *data;
+	size_t used, cap;
+};
+
+struct piece_cache
+{
+	size_t piece, piece_start;
+	size_t ch, byte;
+};
+
+struct piece_tab
+{
+	// the original file is mapped read-only and never modified.
+	uint8_t const *map;
+	size_t map_size;
+	size_t orig_len;
+	size_t *ckpts;
+	bool ascii;
+	
+	// add chunks are never reallocated once created, so pointers into them
+	// stay valid for the lifetime of the table.
+	struct piece_chunk *add_chunks;
+	size_t nadd_chunks;
+	
+	struct piece *pieces;
+	size_t npieces, cap;
+	
+	// lookups are overwhelmingly sequential or local, so the position of
+	// the last lookup is cached.
+	// kept behind a pointer so that reads through a const table can still
+	// update it.
+	struct piece_cache *cache;
+};
+
+int piece_tab_create(struct piece_tab *out, int fd, size_t size, size_t *out_valid);
+void piece_tab_destroy(struct piece_tab *pt);
+void piece_tab_snap(struct piece_tab const *pt, struct piece_tab *out);
+void piece_tab_snap_destroy(struct piece_tab *pt);
+wchar_t piece_tab_get(struct piece_tab const *pt, size_t ind);
+void piece_tab_read(struct piece_tab const *pt, wchar_t *dst, size_t ind, size_t n);
+size_t piece_tab_span(struct piece_tab const *pt, size_t ind, void const **out_data, unsigned char *out_width);
+void piece_tab_insert(struct piece_tab *pt, size_t ind, wchar_t const *wstr, size_t len);
+void piece_tab_erase(struct piece_tab *pt, size_t lb, size_t ub);
+
+#endif
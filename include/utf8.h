@@ -14,5 +14,9 @@ uchar32 utf8_decode_ch(uint8_t const *bytes);
 uint8_t *utf8_encode_ch(uint8_t *out_bytes, uchar32 ch);
 int utf8_decode_str(uchar32 *out_str, uint8_t const *bytes);
 int utf8_encode_str(uint8_t *out_bytes, uchar32 const *str);
+size_t utf8_validate(uint8_t const *bytes, size_t n, size_t *out_nch);
+size_t utf8_decode_buf(uchar32 *out_str, uint8_t const *bytes, size_t n, size_t *out_nch);
+size_t utf8_encode_buf(uint8_t *out_bytes, uchar32 const *str, size_t n);
+int utf8_seq_len(uint8_t lead);
 
 #endif
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <wchar.h>
@@ -19,6 +20,9 @@
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
 
+// the longest encoding of a 64-bit varint.
+#define VARINT_MAX 10
+
 #define K_CTL(k) (k - 'a' + 1)
 #define K_F(n) 27, 79, (79 + n)
 #define K_META(k) 27, k
@@ -93,5 +97,9 @@ char const *file_ext(char const *path);
 int mk_dir_rec(char const *dir);
 int mk_file(char const *path);
 bool is_path_same(char const *pa, char const *pb);
+char *side_path(char const *path, char const *suffix);
+int write_all(int fd, uint8_t const *bytes, size_t n);
+uint8_t *put_varint(uint8_t *bytes, uint64_t v);
+int get_varint(uint8_t const **bytes, uint8_t const *end, uint64_t *out_v);
 
 #endif
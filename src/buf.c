@@ -6,84 +6,382 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "conf.h"
+#include "diff.h"
 #include "prompt.h"
+#include "utf8.h"
 
-// adding entries past `MAX_HIST_SIZE` will cause the earliest existing entries
-// to be deleted in order to make space.
-#define MAX_HIST_SIZE 512
+// undo payloads are allocated out of chunks holding at least this many
+// characters.
+#define HIST_CHUNK_SIZE 4096
 
-VEC_DEF_IMPL(struct buf_op, buf_op)
+// lines are hashed from blocks of this many characters.
+#define LINE_HASH_BLK_SIZE 4096
+
+VEC_DEF_IMPL(struct buf_listener, buf_listener)
 VEC_DEF_IMPL(struct buf *, p_buf)
 
-extern bool flag_r;
+struct buf_share
+{
+	pthread_mutex_t lock;
+	size_t refs;
+	void *conts;
+};
+
+struct buf_load_job
+{
+	pthread_t thread;
+	struct buf loaded;
+	int fd;
+	bool stat_ok;
+	size_t size;
+	uint8_t flags;
+	bool bad_utf8;
+	size_t bad_off;
+	uint64_t hash;
+	size_t len;
+};
+
+struct buf_save_job
+{
+	pthread_t thread;
+	struct buf snap;
+	char *path;
+	int rc;
+	struct stat st;
+	
+	// history to be saved along with the contents, or nothing if it isn't
+	// kept across sessions.
+	// the operations are copied from the buffer, and keep the chunks
+	// holding their payloads alive until the job is reaped, so that they
+	// can be encoded by the worker.
+	struct hist_file_enc hist;
+	struct buf_op *ops;
+	size_t nops;
+	uint64_t hash;
+	size_t len;
+	
+	// lines of the saved contents, which later changes to the file are
+	// merged against.
+	uint64_t *base_lines;
+	size_t nbase_lines;
+	
+	// length of the journal when the save began, as records past it are
+	// not part of the saved file.
+	size_t journal_off;
+};
+
+extern bool flag_d, flag_r;
 
-static void push_hist(struct buf *b, enum buf_op_type type, wchar_t const *data, size_t lb, size_t ub);
+// written to by background jobs once they finish, so that the editor can
+// wait on it alongside keys, see `buf_wake_fd()`.
+static int wake_fds[2] = {-1, -1};
+
+static void push_hist(struct buf *b, enum buf_op_type type, size_t lb, size_t ub);
+static void read_rev(struct buf const *b, wchar_t *dst, size_t lb, size_t ub);
+static void publish(struct buf *b, size_t off, size_t nrm, size_t nins);
+static struct buf_op *hist_at(struct buf_hist const *h, size_t i);
+static int find_op(struct buf_hist const *h, bool redo, size_t *out_ind);
+static void hist_add(struct buf_hist *h, struct buf_op const *op);
+static void hist_truncate(struct buf_hist *h);
+static void hist_evict(struct buf_hist *h);
+static void hist_clear(struct buf_hist *h);
+static wchar_t *hist_alloc(struct buf_hist *h, size_t n, size_t slack, struct hist_chunk **out_chunk);
+static void hist_release(struct buf_hist *h, struct buf_op *op);
+static size_t op_cost(struct buf_op const *op);
+static void mv_gap(struct buf *b, size_t pos);
+static void grow_gap(struct buf *b, size_t n);
+static void ins_gap(struct buf *b, size_t ind, wchar_t const *wstr, size_t len);
+static unsigned char need_width(wchar_t const *wstr, size_t len);
+static void widen(struct buf *b, unsigned char width);
+static void log_mem(struct buf const *b);
+static wchar_t raw_get(void const *conts, unsigned char width, size_t ind);
+static void raw_read(void const *conts, unsigned char width, wchar_t *dst, size_t ind, size_t n);
+static void raw_write(void *conts, unsigned char width, size_t ind, wchar_t const *src, size_t n);
+static void unshare_conts(struct buf *b);
+static void release_share(struct buf_share *sh);
+static void wake_init(void);
+static void wake(void);
+static void *save_worker(void *arg);
+static int save_atomic(struct buf const *snap, char const *path);
+static int write_conts(struct buf const *b, int fd, char const *path);
+static void index_piece(struct buf *b);
+static bool load_file(struct buf *b, int fd, bool stat_ok, size_t size, size_t *out_bad);
+static void load_head(struct buf *b, int fd);
+static int load_gap(struct buf *b, int fd, size_t size_hint, size_t *out_bad);
+static void *load_worker(void *arg);
+static void swap_store(struct buf *a, struct buf *b);
+static void show_bad_utf8(char const *path, size_t off);
+static void record_src(struct buf *b, struct stat const *s);
+static uint64_t *hash_lines(struct buf const *b, size_t *out_n);
+static size_t line_off(struct buf const *b, size_t ln);
+static void replace_all(struct buf *b, struct buf *new);
+static bool merge_hunks(struct diff_hunk const *ours, size_t nours, struct diff_hunk const *theirs, size_t ntheirs, enum buf_merge_mode mode, struct diff_hunk *out, size_t *out_n);
+static void apply_hunks(struct buf *b, struct buf const *new, struct diff_hunk const *hunks, size_t nhunks);
+static void journal_diff(struct buf *b, struct buf const *file);
+static struct buf open_file(char const *path);
+static void recover(struct buf *b);
+static void track_write(struct buf *b, size_t ind, wchar_t const *wstr, size_t len);
+static void track_erase(struct buf *b, size_t lb, size_t ub);
+static int load_hist(struct buf *b);
+static void snap_hist(struct buf *b, struct buf_save_job *job);
+static void release_hist_snap(struct buf *b, struct buf_save_job *job);
+static void enc_hist(struct buf_save_job *job);
+static uint64_t content_hash(struct buf *b);
+static void refresh_modified(struct buf *b);
+static void read_conts(void const *ctx, wchar_t *dst, size_t pos, size_t n);
+static void ins_text(struct buf *b, size_t ind, wchar_t const *wstr, size_t len);
+static void txn_pend(struct buf *b, size_t ind, wchar_t const *wstr, size_t len);
+static void txn_flush(struct buf *b);
 
 struct buf
 buf_create(bool writable)
 {
 	return (struct buf)
 	{
-		.conts_ = malloc(sizeof(wchar_t)),
+		.conts = malloc(1),
+		.width = 1,
 		.size = 0,
 		.cap = 1,
+		.gap_pos = 0,
+		.gap_size = 1,
+		.lines = line_idx_create(),
+		.marks = mark_tree_create(),
+		.store = BS_GAP,
 		.src = NULL,
 		.src_type = BST_FRESH,
 		.flags = writable * BF_WRITABLE,
-		.hist = vec_buf_op_create(),
+		.hist =
+		{
+			.ops = malloc(sizeof(struct buf_op)),
+			.cap = 1,
+			.first = 0,
+			.size = 0,
+			.cur = 0,
+			.nbytes = 0,
+			.top = NULL,
+			.sealed = false,
+			.file =
+			{
+				.map = NULL,
+				.len = 0,
+				.end = 0,
+			},
+		},
+		.save_job = NULL,
+		.base_lines = NULL,
+		.nbase_lines = 0,
+		.watch = -1,
+		.journal = NULL,
+		.saved_hash = 0,
+		.saved_len = 0,
+		.txn_depth = 0,
+		.txn_ins = NULL,
+		.txn_len = 0,
+		.txn_cap = 0,
+		.txn_pos = 0,
+		.ver = 0,
+		.listeners = vec_buf_listener_create(),
 	};
 }
 
 struct buf
 buf_from_file(char const *path)
 {
-	FILE *fp = fopen(path, "rb");
-	if (!fp)
-	{
-		size_t msg_len = sizeof(wchar_t) * (strlen(path) + 20);
-		wchar_t *msg = malloc(msg_len);
-		swprintf(msg, msg_len, L"cannot read file: %s!", path);
-		prompt_show(msg);
-		free(msg);
-		return buf_create(false);
-	}
+	// files loaded in the background are checked for a journal once the
+	// load is reaped.
+	struct buf b = open_file(path);
+	if (!b.load_job)
+		recover(&b);
 	
-	struct buf b = buf_create(true);
-	b.flags = BF_WRITABLE | BF_NO_HIST;
+	return b;
+}
+
+struct buf
+buf_from_file_lazy(char const *path)
+{
+	// nothing is read until the buffer is materialized, so the buffer
+	// starts out empty and cannot be edited.
+	// the file is only stat'd, so that changes to it can still be told
+	// apart from the version that was opened.
+	struct buf b = buf_create(false);
 	b.src_type = BST_FILE;
 	b.src = strdup(path);
+	b.flags = BF_LAZY;
+	buf_note_src(&b);
+	
+	return b;
+}
+
+void
+buf_materialize(struct buf *b)
+{
+	if (!(b->flags & BF_LAZY))
+		return;
+	
+	struct buf loaded = open_file(b->src);
+	swap_store(b, &loaded);
+	b->load_job = loaded.load_job;
+	loaded.load_job = NULL;
+	b->flags = loaded.flags;
+	b->src_mtime = loaded.src_mtime;
+	b->src_size = loaded.src_size;
+	b->saved_hash = loaded.saved_hash;
+	b->saved_len = loaded.saved_len;
+	b->hist.file = loaded.hist.file;
+	loaded.hist.file.map = NULL;
+	b->base_lines = loaded.base_lines;
+	b->nbase_lines = loaded.nbase_lines;
+	loaded.base_lines = NULL;
+	buf_destroy(&loaded);
+	
+	mark_tree_insert(&b->marks, 0, b->size);
+	publish(b, 0, 0, b->size);
+	
+	if (!b->load_job)
+		recover(b);
+}
+
+bool
+buf_src_changed(struct buf const *b)
+{
+	struct stat s;
+	if (b->src_type != BST_FILE || stat(b->src, &s))
+		return false;
 	
-	errno = 0;
-	wint_t wch;
-	while ((wch = fgetwc(fp)) != WEOF)
-		buf_write_wch(&b, b.size, wch);
+	return s.st_mtim.tv_sec != b->src_mtime.tv_sec
+	       || s.st_mtim.tv_nsec != b->src_mtime.tv_nsec
+	       || s.st_size < 0
+	       || (size_t)s.st_size != b->src_size;
+}
+
+void
+buf_note_src(struct buf *b)
+{
+	// the current state of the file is taken as known, so that it isn't
+	// reported as changed again.
+	struct stat s;
+	if (b->src_type == BST_FILE && !stat(b->src, &s))
+		record_src(b, &s);
+}
+
+enum buf_merge_status
+buf_merge(struct buf *b, enum buf_merge_mode mode)
+{
+	int fd = open(b->src, O_RDONLY);
+	if (fd == -1)
+		return BMS_FAIL;
 	
-	if (errno == EILSEQ)
+	struct stat s;
+	if (fstat(fd, &s))
 	{
-		size_t msg_len = sizeof(wchar_t) * (strlen(path) + 31);
-		wchar_t *msg = malloc(msg_len);
-		swprintf(msg, msg_len, L"file contains invalid UTF-8: %s!", path);
-		prompt_show(msg);
-		free(msg);
+		close(fd);
+		return BMS_FAIL;
 	}
-
-	fclose(fp);
 	
-	int ea = euidaccess(path, W_OK);
-	if (ea != 0 || flag_r)
+	struct buf new = buf_create(true);
+	new.flags = BF_WRITABLE | BF_NO_HIST;
+	size_t bad_off;
+	load_file(&new, fd, true, s.st_size, &bad_off);
+	close(fd);
+	
+	// mapped contents reflect the file as it is now rather than as it was
+	// opened, or fault if it was truncated, so they are never read again.
+	// without them, there is nothing to tell unsaved edits apart by, and
+	// all of them are taken to conflict.
+	bool modified = b->flags & BF_MODIFIED;
+	if (b->store == BS_PIECE || new.store == BS_PIECE || (modified && !b->base_lines))
 	{
-		size_t msg_len = sizeof(wchar_t) * (strlen(path) + 24);
-		wchar_t *msg = malloc(msg_len);
-		swprintf(msg, msg_len, L"opening file readonly: %s", path);
-		prompt_show(msg);
-		free(msg);
+		if (modified && mode != BMM_TAKE_FILE)
+		{
+			buf_destroy(&new);
+			if (mode == BMM_NONE)
+				return BMS_CONFLICT;
+			record_src(b, &s);
+			return BMS_OK;
+		}
+		
+		if (b->journal)
+		{
+			journal_close(b->journal);
+			b->journal = NULL;
+		}
+		
+		free(b->base_lines);
+		b->base_lines = new.base_lines;
+		b->nbase_lines = new.nbase_lines;
+		new.base_lines = NULL;
+		
+		replace_all(b, &new);
+		buf_destroy(&new);
+		record_src(b, &s);
+		return BMS_OK;
 	}
 	
-	b.flags = (!ea && !flag_r) * BF_WRITABLE;
+	// edits made since the file was last read are found by comparing
+	// against what it looked like then, and so are changes made to the
+	// file itself.
+	// an unmodified buffer still looks like the file did, whether or not
+	// the lines it was read with are known.
+	size_t nbuf;
+	uint64_t *hbuf = hash_lines(b, &nbuf);
+	uint64_t const *hbase = modified ? b->base_lines : hbuf;
+	size_t nbase = modified ? b->nbase_lines : nbuf;
 	
-	return b;
+	struct diff_hunk *ours = NULL, *theirs;
+	size_t nours = modified ? diff_lines(hbase, nbase, hbuf, nbuf, CONF_RELOAD_MAX_DIFF, &ours) : 0;
+	size_t ntheirs = diff_lines(hbase, nbase, new.base_lines, new.nbase_lines, CONF_RELOAD_MAX_DIFF, &theirs);
+	
+	struct diff_hunk *hunks = malloc(sizeof(struct diff_hunk) * (ntheirs + 1));
+	size_t nhunks;
+	bool conflict = merge_hunks(ours, nours, theirs, ntheirs, mode, hunks, &nhunks);
+	free(hbuf);
+	free(ours);
+	free(theirs);
+	
+	if (conflict && mode == BMM_NONE)
+	{
+		free(hunks);
+		buf_destroy(&new);
+		return BMS_CONFLICT;
+	}
+	
+	// the edits which bring in the changes are not journaled as they are
+	// made, as the journal is started over against the file as it is now
+	// once they are done.
+	if (b->journal)
+	{
+		journal_close(b->journal);
+		b->journal = NULL;
+	}
+	
+	uint8_t flags = b->flags;
+	b->flags |= BF_WRITABLE | BF_NO_JOURNAL;
+	apply_hunks(b, &new, hunks, nhunks);
+	b->flags = flags;
+	free(hunks);
+	
+	record_src(b, &s);
+	free(b->base_lines);
+	b->base_lines = new.base_lines;
+	b->nbase_lines = new.nbase_lines;
+	new.base_lines = NULL;
+	
+	b->saved_hash = content_hash(&new);
+	b->saved_len = new.size;
+	refresh_modified(b);
+	if (b->flags & BF_MODIFIED)
+		journal_diff(b, &new);
+	
+	buf_destroy(&new);
+	
+	return BMS_OK;
 }
 
 struct buf
@@ -94,6 +392,8 @@ buf_from_wstr(wchar_t const *wstr, bool writable)
 	b.flags = BF_WRITABLE | BF_NO_HIST;
 	buf_write_wstr(&b, 0, wstr);
 	b.flags = writable * BF_WRITABLE;
+	b.saved_hash = content_hash(&b);
+	b.saved_len = b.size;
 
 	return b;
 }
@@ -110,74 +410,368 @@ buf_save(struct buf *b)
 	if (!(b->flags & BF_MODIFIED))
 		return 0;
 	
-	FILE *fp = fopen(b->src, "wb");
-	if (!fp)
+	// only one save per buffer is ever in flight.
+	if (buf_reap_save(b, true))
 		return 1;
 	
-	for (size_t i = 0; i < b->size; ++i)
+	struct buf_save_job *job = malloc(sizeof(struct buf_save_job));
+	char *real_path = realpath(b->src, NULL);
+	job->path = real_path ? real_path : strdup(b->src);
+	buf_snap(b, &job->snap);
+	job->rc = 0;
+	job->hist = (struct hist_file_enc){NULL, 0, 0};
+	job->ops = NULL;
+	job->nops = 0;
+	if (CONF_UNDO_PERSIST)
+		snap_hist(b, job);
+	job->journal_off = b->journal ? journal_len(b->journal) : 0;
+	job->hash = content_hash(b);
+	job->len = b->size;
+	job->base_lines = NULL;
+	job->nbase_lines = 0;
+	
+	wake_init();
+	if (pthread_create(&job->thread, NULL, save_worker, job))
 	{
-		wchar_t wcs[] = {b->conts_[i], 0};
-		char mbs[sizeof(wchar_t) + 1] = {0};
-		wcstombs(mbs, wcs, sizeof(wchar_t) + 1);
-		fputs(mbs, fp);
+		buf_snap_destroy(&job->snap);
+		release_hist_snap(b, job);
+		free(job->hist.bytes);
+		free(job->path);
+		free(job);
+		return 1;
 	}
-
-	fclose(fp);
+	
+	// edits made while the save is in flight mark the buffer as modified
+	// again, since they aren't part of the snapshot.
+	b->save_job = job;
+	b->flags |= BF_SAVING;
 	b->flags &= ~BF_MODIFIED;
 	
 	return 0;
 }
 
+unsigned
+buf_load_pct(struct buf const *b)
+{
+	struct buf_load_job const *job = b->load_job;
+	if (!job)
+		return 100;
+	
+	// the worker reads the file in order through its own descriptor, so
+	// how far along it is can be told from the file offset without
+	// needing to synchronize with it.
+	// mapped files don't move the offset, and show no progress until
+	// they are done.
+	off_t off = lseek(job->fd, 0, SEEK_CUR);
+	if (off <= 0 || !job->size)
+		return 0;
+	
+	return MIN(99, (size_t)off * 100 / job->size);
+}
+
+int
+buf_wake_fd(void)
+{
+	wake_init();
+	return wake_fds[0];
+}
+
+int
+buf_reap_save(struct buf *b, bool wait)
+{
+	struct buf_save_job *job = b->save_job;
+	if (!job)
+		return 0;
+	
+	if (wait)
+		pthread_join(job->thread, NULL);
+	else if (pthread_tryjoin_np(job->thread, NULL))
+		return 0;
+	
+	int rc = job->rc;
+	size_t journal_off = job->journal_off;
+	if (!rc)
+	{
+		record_src(b, &job->st);
+		b->saved_hash = job->hash;
+		b->saved_len = job->len;
+		
+		free(b->base_lines);
+		b->base_lines = job->base_lines;
+		b->nbase_lines = job->nbase_lines;
+		job->base_lines = NULL;
+	}
+	
+	buf_snap_destroy(&job->snap);
+	free(job->base_lines);
+	release_hist_snap(b, job);
+	free(job->hist.bytes);
+	free(job->path);
+	free(job);
+	
+	b->save_job = NULL;
+	b->flags &= ~BF_SAVING;
+	
+	// the file no longer matches the buffer, even if nothing has been
+	// edited since the save began.
+	// otherwise, edits made since may well have been undone again.
+	if (rc)
+		b->flags |= BF_MODIFIED;
+	else
+		refresh_modified(b);
+	
+	// edits made while saving still need to be journaled, but on top of
+	// the newly saved file.
+	if (!rc && b->journal)
+	{
+		if (b->flags & BF_MODIFIED)
+			b->journal = journal_rebase(b->journal, journal_off, b->src_mtime, b->src_size);
+		else
+		{
+			journal_close(b->journal);
+			b->journal = NULL;
+		}
+	}
+	
+	return rc;
+}
+
+void
+buf_reap_load(struct buf *b, bool wait)
+{
+	struct buf_load_job *job = b->load_job;
+	if (!job)
+		return;
+	
+	if (wait)
+		pthread_join(job->thread, NULL);
+	else if (pthread_tryjoin_np(job->thread, NULL))
+		return;
+	
+	// the loaded contents replace those of the start of the file, which
+	// then get destroyed along with the rest of the job.
+	size_t head = b->size;
+	swap_store(b, &job->loaded);
+	b->base_lines = job->loaded.base_lines;
+	b->nbase_lines = job->loaded.nbase_lines;
+	job->loaded.base_lines = NULL;
+	buf_destroy(&job->loaded);
+	close(job->fd);
+	
+	b->load_job = NULL;
+	b->flags = job->flags;
+	b->saved_hash = job->hash;
+	b->saved_len = job->len;
+	
+	// to anything tracking positions, the rest of the file looks as if it
+	// had been appended to its start.
+	if (b->size >= head)
+	{
+		mark_tree_insert(&b->marks, head, b->size - head);
+		publish(b, head, 0, b->size - head);
+	}
+	else
+	{
+		mark_tree_erase(&b->marks, b->size, head);
+		publish(b, b->size, head - b->size, 0);
+	}
+	
+	if (job->bad_utf8)
+		show_bad_utf8(b->src, job->bad_off);
+	
+	free(job);
+	
+	recover(b);
+}
+
 int
 buf_undo(struct buf *b)
 {
 	if (!(b->flags & BF_WRITABLE))
 		return 1;
-
-	while (b->hist.size > 0 && b->hist.data[b->hist.size - 1].type == BOT_BRK)
-		vec_buf_op_rm(&b->hist, b->hist.size - 1);
-
+	
 	// this is not a failure, so a 0 is returned.
 	// having nothing happen upon undoing a non-action is the expected
 	// result.
-	if (b->hist.size == 0)
+	struct buf_hist *h = &b->hist;
+	size_t ind;
+	if (find_op(h, false, &ind) && (load_hist(b) || find_op(h, false, &ind)))
 		return 0;
-
-	struct buf_op const *bo = &b->hist.data[b->hist.size - 1];
+	
+	struct buf_op *bo = hist_at(h, ind);
+	h->cur = ind;
+	
+	b->flags |= BF_NO_HIST;
 	switch (bo->type)
 	{
 	case BOT_WRITE:
-		b->flags |= BF_NO_HIST;
+		// written text is only kept around while it can be redone.
+		bo->data = hist_alloc(h, bo->ub - bo->lb + 1, 0, &bo->chunk);
+		buf_get_wstr(b, bo->data, bo->lb, bo->ub - bo->lb + 1);
+		h->nbytes += op_cost(bo) - sizeof(struct buf_op);
 		buf_erase(b, bo->lb, bo->ub);
-		b->flags &= ~BF_NO_HIST;
 		break;
 	case BOT_ERASE:
-		b->flags |= BF_NO_HIST;
-		buf_write_wstr(b, bo->lb, bo->data);
-		b->flags &= ~BF_NO_HIST;
-		free(bo->data);
+	{
+		// erased text is stored back to front, see `push_hist()`.
+		size_t len = bo->ub - bo->lb;
+		wchar_t *wstr = malloc(sizeof(wchar_t) * (len + 1));
+		for (size_t i = 0; i < len; ++i)
+			wstr[i] = bo->data[len - 1 - i];
+		wstr[len] = 0;
+		
+		buf_write_wstr(b, bo->lb, wstr);
+		free(wstr);
 		break;
 	}
+	}
+	b->flags &= ~BF_NO_HIST;
+	
+	// further edits must not be merged into an operation from before
+	// the undo.
+	h->sealed = true;
+	
+	return 0;
+}
 
-	vec_buf_op_rm(&b->hist, b->hist.size - 1);
-	buf_push_hist_brk(b);
+int
+buf_redo(struct buf *b)
+{
+	if (!(b->flags & BF_WRITABLE))
+		return 1;
+	
+	struct buf_hist *h = &b->hist;
+	size_t ind;
+	if (find_op(h, true, &ind))
+		return 0;
+	
+	struct buf_op *bo = hist_at(h, ind);
+	h->cur = ind + 1;
+	
+	b->flags |= BF_NO_HIST;
+	switch (bo->type)
+	{
+	case BOT_WRITE:
+		buf_write_wstr(b, bo->lb, bo->data);
+		h->nbytes -= op_cost(bo) - sizeof(struct buf_op);
+		hist_release(h, bo);
+		break;
+	case BOT_ERASE:
+		buf_erase(b, bo->lb, bo->ub);
+		break;
+	}
+	b->flags &= ~BF_NO_HIST;
+	
+	h->sealed = true;
+	
 	return 0;
 }
 
+struct buf_op const *
+buf_peek_undo(struct buf *b)
+{
+	// older history is read back as soon as it is needed, which can only
+	// be once everything after it has been undone.
+	size_t ind;
+	if (find_op(&b->hist, false, &ind) && (load_hist(b) || find_op(&b->hist, false, &ind)))
+		return NULL;
+	
+	return hist_at(&b->hist, ind);
+}
+
+struct buf_op const *
+buf_peek_redo(struct buf const *b)
+{
+	size_t ind;
+	return find_op(&b->hist, true, &ind) ? NULL : hist_at(&b->hist, ind);
+}
+
 void
 buf_destroy(struct buf *b)
 {
-	free(b->conts_);
+	buf_reap_load(b, true);
+	buf_reap_save(b, true);
+	
+	// buffers are only destroyed on purpose, after which their edits no
+	// longer need recovering.
+	if (b->journal)
+		journal_close(b->journal);
+	
+	if (b->share)
+		release_share(b->share);
+	else
+		free(b->conts);
+	if (b->store == BS_PIECE)
+		piece_tab_destroy(&b->pt);
+	line_idx_destroy(&b->lines);
+	mark_tree_destroy(&b->marks);
 	
 	if (b->src)
 		free(b->src);
 
 	for (size_t i = 0; i < b->hist.size; ++i)
+		hist_release(&b->hist, hist_at(&b->hist, i));
+	free(b->hist.ops);
+	free(b->hist.top);
+	hist_file_close(&b->hist.file);
+	
+	free(b->base_lines);
+	free(b->txn_ins);
+	vec_buf_listener_destroy(&b->listeners);
+}
+
+void
+buf_snap(struct buf *b, struct buf *out)
+{
+	// the snapshot only holds as much state as is needed to read its
+	// contents back through `buf_get_wch()` and `buf_get_wstr()`, and
+	// must be destroyed before the buffer it was taken from.
+	*out = (struct buf)
+	{
+		.conts = NULL,
+		.width = b->width,
+		.store = b->store,
+		.size = b->size,
+		.cap = b->cap,
+		.gap_pos = b->gap_pos,
+		.gap_size = b->gap_size,
+		.src_type = BST_FRESH,
+		.flags = 0,
+	};
+	
+	// pieces never modify the text they refer to, so a piece table can
+	// be snapshotted just by copying its piece list.
+	if (b->store == BS_PIECE)
 	{
-		if (b->hist.data[i].data)
-			free(b->hist.data[i].data);
+		piece_tab_snap(&b->pt, &out->pt);
+		return;
+	}
+	
+	// gap buffer contents are shared until the buffer is next edited, so
+	// taking a snapshot costs nothing up front.
+	if (!b->share)
+	{
+		b->share = malloc(sizeof(struct buf_share));
+		pthread_mutex_init(&b->share->lock, NULL);
+		b->share->refs = 1;
+		b->share->conts = b->conts;
 	}
-	vec_buf_op_destroy(&b->hist);
+	
+	pthread_mutex_lock(&b->share->lock);
+	++b->share->refs;
+	pthread_mutex_unlock(&b->share->lock);
+	
+	out->conts = b->conts;
+	out->share = b->share;
+}
+
+void
+buf_snap_destroy(struct buf *snap)
+{
+	if (snap->store == BS_PIECE)
+		piece_tab_snap_destroy(&snap->pt);
+	else
+		release_share(snap->share);
 }
 
 void
@@ -186,19 +780,10 @@ buf_write_wch(struct buf *b, size_t ind, wchar_t wch)
 	if (!(b->flags & BF_WRITABLE))
 		return;
 
-	if (b->size >= b->cap)
-	{
-		b->cap *= 2;
-		b->conts_ = realloc(b->conts_, sizeof(wchar_t) * b->cap);
-	}
-
-	memmove(b->conts_ + ind + 1,
-	        b->conts_ + ind,
-	        sizeof(wchar_t) * (b->size - ind));
-	b->conts_[ind] = wch;
-	++b->size;
-	b->flags |= BF_MODIFIED;
-	push_hist(b, BOT_WRITE, NULL, ind, ind + 1);
+	if (b->txn_depth)
+		txn_pend(b, ind, &wch, 1);
+	else
+		ins_text(b, ind, &wch, 1);
 }
 
 void
@@ -208,27 +793,10 @@ buf_write_wstr(struct buf *b, size_t ind, wchar_t const *wstr)
 		return;
 
 	size_t len = wcslen(wstr);
-	size_t newcap = b->cap;
-	
-	for (size_t i = 1; i <= len; ++i)
-	{
-		if (b->size + i > newcap)
-			newcap *= 2;
-	}
-
-	if (b->cap != newcap)
-	{
-		b->cap = newcap;
-		b->conts_ = realloc(b->conts_, sizeof(wchar_t) * b->cap);
-	}
-
-	memmove(b->conts_ + ind + len,
-	        b->conts_ + ind,
-	        sizeof(wchar_t) * (b->size - ind));
-	memcpy(b->conts_ + ind, wstr, sizeof(wchar_t) * len);
-	b->size += len;
-	b->flags |= BF_MODIFIED;
-	push_hist(b, BOT_WRITE, NULL, ind, ind + len);
+	if (b->txn_depth)
+		txn_pend(b, ind, wstr, len);
+	else
+		ins_text(b, ind, wstr, len);
 }
 
 void
@@ -236,80 +804,269 @@ buf_erase(struct buf *b, size_t lb, size_t ub)
 {
 	if (!(b->flags & BF_WRITABLE))
 		return;
+	
+	// positions given inside a transaction already account for any
+	// writes being held back.
+	txn_flush(b);
 
-	push_hist(b, BOT_ERASE, b->conts_ + lb, lb, ub);
-	memmove(b->conts_ + lb, b->conts_ + ub, sizeof(wchar_t) * (b->size - ub));
+	// the erased text is recorded before it is gone.
+	push_hist(b, BOT_ERASE, lb, ub);
+	
+	if (b->store == BS_PIECE)
+		piece_tab_erase(&b->pt, lb, ub);
+	else
+	{
+		if (b->share)
+			unshare_conts(b);
+		mv_gap(b, lb);
+		b->gap_size += ub - lb;
+	}
+	
+	line_idx_erase(&b->lines, lb, ub);
+	mark_tree_erase(&b->marks, lb, ub);
+	
 	b->size -= ub - lb;
-	b->flags |= BF_MODIFIED;
+	refresh_modified(b);
+	track_erase(b, lb, ub);
+	publish(b, lb, ub - lb, 0);
 }
 
 void
 buf_push_hist_brk(struct buf *b)
 {
-	if (b->hist.size > 0)
-		push_hist(b, BOT_BRK, NULL, 0, 1);
+	if (b->hist.cur > 0)
+		push_hist(b, BOT_BRK, 0, 1);
 }
 
 void
-buf_pos(struct buf const *b, size_t pos, unsigned *out_r, unsigned *out_c)
+buf_txn_begin(struct buf *b)
 {
-	pos = MIN(pos, b->size);
-	
-	*out_r = *out_c = 0;
+	// the buffer must not be read from until the matching
+	// `buf_txn_end()`, as held back writes are not visible yet.
+	++b->txn_depth;
+}
+
+void
+buf_txn_end(struct buf *b)
+{
+	if (b->txn_depth && !--b->txn_depth)
+		txn_flush(b);
+}
+
+void
+buf_listen(struct buf *b,
+           void (*fn)(struct buf_delta const *, void *),
+           void *ctx)
+{
+	struct buf_listener l =
+	{
+		.fn = fn,
+		.ctx = ctx,
+	};
+	vec_buf_listener_add(&b->listeners, &l);
+}
 
-	for (size_t i = 0; i < pos; ++i)
+void
+buf_unlisten(struct buf *b,
+             void (*fn)(struct buf_delta const *, void *),
+             void *ctx)
+{
+	for (size_t i = 0; i < b->listeners.size; ++i)
 	{
-		++*out_c;
-		if (buf_get_wch(b, i) == L'\n')
+		struct buf_listener const *l = &b->listeners.data[i];
+		if (l->fn == fn && l->ctx == ctx)
 		{
-			*out_c = 0;
-			++*out_r;
+			vec_buf_listener_rm(&b->listeners, i);
+			return;
 		}
 	}
 }
 
-wchar_t
-buf_get_wch(struct buf const *b, size_t ind)
+void
+buf_pos(struct buf const *b, size_t pos, unsigned *out_r, unsigned *out_c)
 {
-	return b->conts_[ind];
+	size_t ln, col;
+	line_idx_pos(&b->lines, MIN(pos, b->size), &ln, &col);
+	
+	*out_r = ln;
+	*out_c = col;
 }
 
-wchar_t *
-buf_get_wstr(struct buf const *b, wchar_t *dst, size_t ind, size_t n)
+size_t
+buf_line_start(struct buf const *b, size_t ln)
 {
-	n = MIN(n, b->size - ind);
-	if (ind >= b->size || !n)
-	{
-		dst[0] = 0;
-		return dst;
-	}
-	
-	wcsncpy(dst, &b->conts_[ind], n - 1);
-	dst[n - 1] = 0;
-	return dst;
+	return line_idx_start(&b->lines, ln);
 }
 
-static void
-push_hist(struct buf *b,
-          enum buf_op_type type,
-          wchar_t const *data,
-          size_t lb,
-          size_t ub)
+size_t
+buf_line_end(struct buf const *b, size_t ln)
 {
-	if (b->flags & BF_NO_HIST)
-		return;
+	// the end of a line is the position of its newline, or the end of the
+	// buffer for the last line.
+	size_t len = line_idx_len(&b->lines, ln);
+	size_t ub = line_idx_start(&b->lines, ln) + len;
+	return ln + 1 < line_idx_cnt(&b->lines) ? ub - 1 : ub;
+}
 
-	if (lb >= ub)
-		return;
-	
-	while (b->hist.size >= MAX_HIST_SIZE)
-	{
-		if (b->hist.data[0].data)
-			free(b->hist.data[0].data);
-		vec_buf_op_rm(&b->hist, 0);
-	}
+size_t
+buf_line_cnt(struct buf const *b)
+{
+	return line_idx_cnt(&b->lines);
+}
 
-	struct buf_op *prev = b->hist.size > 0 ? &b->hist.data[b->hist.size - 1] : NULL;
+size_t
+buf_mark_add(struct buf *b, size_t pos)
+{
+	return mark_tree_add(&b->marks, MIN(pos, b->size));
+}
+
+void
+buf_mark_rm(struct buf *b, size_t mark)
+{
+	mark_tree_rm(&b->marks, mark);
+}
+
+size_t
+buf_mark_get(struct buf const *b, size_t mark)
+{
+	return mark_tree_get(&b->marks, mark);
+}
+
+void
+buf_mark_put(struct buf *b, size_t mark, size_t pos)
+{
+	mark_tree_put(&b->marks, mark, MIN(pos, b->size));
+}
+
+wchar_t
+buf_get_wch(struct buf const *b, size_t ind)
+{
+	// a lot of code relies on peeking one past the end of the buffer, so
+	// out-of-range reads are given a null character rather than gap junk.
+	if (ind >= b->size)
+		return 0;
+	
+	if (b->store == BS_PIECE)
+		return piece_tab_get(&b->pt, ind);
+	
+	return raw_get(b->conts, b->width, ind < b->gap_pos ? ind : ind + b->gap_size);
+}
+
+wchar_t *
+buf_get_wstr(struct buf const *b, wchar_t *dst, size_t ind, size_t n)
+{
+	n = MIN(n, b->size - ind + 1);
+	if (ind >= b->size || !n)
+	{
+		dst[0] = 0;
+		return dst;
+	}
+	
+	size_t ncpy = n - 1;
+	if (b->store == BS_PIECE)
+	{
+		piece_tab_read(&b->pt, dst, ind, ncpy);
+		dst[ncpy] = 0;
+		return dst;
+	}
+	
+	// the requested region may straddle the gap, in which case it is
+	// copied out in two parts.
+	size_t nlow = ind < b->gap_pos ? MIN(ncpy, b->gap_pos - ind) : 0;
+	
+	raw_read(b->conts, b->width, dst, ind, nlow);
+	raw_read(b->conts,
+	         b->width,
+	         dst + nlow,
+	         ind + nlow + b->gap_size,
+	         ncpy - nlow);
+	dst[ncpy] = 0;
+	
+	return dst;
+}
+
+size_t
+buf_span_at(struct buf const *b, size_t ind, struct buf_span *out)
+{
+	out->len = 0;
+	if (ind >= b->size)
+		return 0;
+	
+	if (b->store == BS_PIECE)
+	{
+		out->len = piece_tab_span(&b->pt, ind, &out->data, &out->width);
+		return out->len;
+	}
+	
+	// the run ends either at the gap or at the end of the buffer.
+	size_t raw = ind < b->gap_pos ? ind : ind + b->gap_size;
+	out->data = (uint8_t const *)b->conts + b->width * raw;
+	out->width = b->width;
+	out->len = ind < b->gap_pos ? b->gap_pos - ind : b->size - ind;
+	
+	return out->len;
+}
+
+wchar_t
+buf_span_get(struct buf_span const *s, size_t i)
+{
+	return raw_get(s->data, s->width, i);
+}
+
+bool
+buf_match_at(struct buf const *b, size_t ind, wchar_t const *lit)
+{
+	// literals are compared against the contents in place, a run at a time,
+	// so that nothing needs copying out.
+	while (*lit)
+	{
+		struct buf_span s;
+		if (!buf_span_at(b, ind, &s))
+		{
+			// the character is not stored in a fixed-width run, or is
+			// past the end of the buffer, in which case this gives a
+			// mismatching null.
+			if (buf_get_wch(b, ind) != *lit)
+				return false;
+			
+			++ind;
+			++lit;
+			continue;
+		}
+		
+		size_t i;
+		for (i = 0; i < s.len && lit[i]; ++i)
+		{
+			if (raw_get(s.data, s.width, i) != lit[i])
+				return false;
+		}
+		
+		ind += i;
+		lit += i;
+	}
+	
+	return true;
+}
+
+static void
+push_hist(struct buf *b,
+          enum buf_op_type type,
+          size_t lb,
+          size_t ub)
+{
+	if (b->flags & BF_NO_HIST)
+		return;
+
+	if (lb >= ub)
+		return;
+	
+	struct buf_hist *h = &b->hist;
+	
+	// a new edit makes anything that was undone impossible to redo.
+	hist_truncate(h);
+	
+	struct buf_op *prev = h->size > 0 && !h->sealed ? hist_at(h, h->size - 1) : NULL;
+	h->sealed = false;
 
 	switch (type)
 	{
@@ -322,36 +1079,57 @@ push_hist(struct buf *b,
 			{
 				.type = BOT_WRITE,
 				.data = NULL,
+				.chunk = NULL,
 				.lb = lb,
 				.ub = ub,
 			};
-			vec_buf_op_add(&b->hist, &new);
+			hist_add(h, &new);
 		}
 		break;
 	case BOT_ERASE:
+		// erased text is stored back to front, so that erasing backwards
+		// only ever appends to the payload of the previous erase.
 		if (prev && prev->type == BOT_ERASE && ub == prev->lb)
 		{
-			size_t size = sizeof(wchar_t) * (ub - lb);
-			size_t psize = sizeof(wchar_t) * (prev->ub - prev->lb);
+			size_t n = ub - lb, plen = prev->ub - prev->lb;
+			struct hist_chunk *top = h->top;
+			
+			// the payload can usually be extended in place, as it was the
+			// last thing allocated.
+			// otherwise, it is moved into a chunk with enough slack for
+			// it to double in size before needing to move again.
+			h->nbytes -= op_cost(prev);
+			if (prev->chunk != top
+			    || prev->data + plen != top->data + top->used
+			    || top->cap - top->used < n)
+			{
+				struct hist_chunk *chunk;
+				wchar_t *new_data = hist_alloc(h, plen, plen + n, &chunk);
+				memcpy(new_data, prev->data, sizeof(wchar_t) * plen);
+				hist_release(h, prev);
+				
+				prev->data = new_data;
+				prev->chunk = chunk;
+				top = h->top;
+			}
+			
+			read_rev(b, prev->data + plen, lb, ub);
+			top->used += n;
 			
-			prev->data = realloc(prev->data, size + psize + sizeof(wchar_t));
-			memmove(prev->data + ub - lb, prev->data, psize);
-			memcpy(prev->data, data, size);
-			prev->data[prev->ub - lb] = 0;
 			prev->lb = lb;
+			h->nbytes += op_cost(prev);
 		}
 		else
 		{
 			struct buf_op new =
 			{
 				.type = BOT_ERASE,
-				.data = malloc(sizeof(wchar_t) * (ub - lb + 1)),
 				.lb = lb,
 				.ub = ub,
 			};
-			memcpy(new.data, data, sizeof(wchar_t) * (ub - lb));
-			new.data[ub - lb] = 0;
-			vec_buf_op_add(&b->hist, &new);
+			new.data = hist_alloc(h, ub - lb, 0, &new.chunk);
+			read_rev(b, new.data, lb, ub);
+			hist_add(h, &new);
 		}
 		break;
 	case BOT_BRK:
@@ -360,11 +1138,1424 @@ push_hist(struct buf *b,
 		{
 			.type = BOT_BRK,
 			.data = NULL,
+			.chunk = NULL,
 			.lb = 0,
 			.ub = 0,
 		};
-		vec_buf_op_add(&b->hist, &new);
+		hist_add(h, &new);
+		break;
+	}
+	}
+	
+	hist_evict(h);
+}
+
+static void
+read_rev(struct buf const *b, wchar_t *dst, size_t lb, size_t ub)
+{
+	// erased text is copied straight from the contents into its payload
+	// a run at a time, so that recording an erase allocates nothing more
+	// than its share of a chunk.
+	size_t n = ub - lb;
+	while (lb < ub)
+	{
+		struct buf_span s;
+		size_t len = MIN(buf_span_at(b, lb, &s), ub - lb);
+		if (!len)
+		{
+			dst[--n] = buf_get_wch(b, lb++);
+			continue;
+		}
+		
+		for (size_t i = 0; i < len; ++i)
+			dst[n - 1 - i] = raw_get(s.data, s.width, i);
+		
+		n -= len;
+		lb += len;
+	}
+}
+
+static void
+publish(struct buf *b, size_t off, size_t nrm, size_t nins)
+{
+	// listeners are told about every edit, including those made by undo
+	// and redo, once the buffer is already in its new state.
+	struct buf_delta d =
+	{
+		.off = off,
+		.nrm = nrm,
+		.nins = nins,
+		.ver = ++b->ver,
+	};
+	
+	for (size_t i = 0; i < b->listeners.size; ++i)
+		b->listeners.data[i].fn(&d, b->listeners.data[i].ctx);
+}
+
+static struct buf_op *
+hist_at(struct buf_hist const *h, size_t i)
+{
+	return &h->ops[(h->first + i) % h->cap];
+}
+
+static int
+find_op(struct buf_hist const *h, bool redo, size_t *out_ind)
+{
+	// breaks only mark boundaries between operations, so they are skipped
+	// over rather than being undone or redone themselves.
+	if (redo)
+	{
+		for (size_t i = h->cur; i < h->size; ++i)
+		{
+			if (hist_at(h, i)->type != BOT_BRK)
+			{
+				*out_ind = i;
+				return 0;
+			}
+		}
+	}
+	else
+	{
+		for (size_t i = h->cur; i > 0; --i)
+		{
+			if (hist_at(h, i - 1)->type != BOT_BRK)
+			{
+				*out_ind = i - 1;
+				return 0;
+			}
+		}
+	}
+	
+	return 1;
+}
+
+static void
+hist_add(struct buf_hist *h, struct buf_op const *op)
+{
+	if (h->size == h->cap)
+	{
+		// the ring is unrolled into the new allocation so that the oldest
+		// operation ends up at the start again.
+		struct buf_op *new_ops = malloc(sizeof(struct buf_op) * 2 * h->cap);
+		for (size_t i = 0; i < h->size; ++i)
+			new_ops[i] = *hist_at(h, i);
+		
+		free(h->ops);
+		h->ops = new_ops;
+		h->first = 0;
+		h->cap *= 2;
+	}
+	
+	*hist_at(h, h->size++) = *op;
+	h->cur = h->size;
+	h->nbytes += op_cost(op);
+}
+
+static void
+hist_truncate(struct buf_hist *h)
+{
+	while (h->size > h->cur)
+	{
+		struct buf_op *op = hist_at(h, --h->size);
+		h->nbytes -= op_cost(op);
+		hist_release(h, op);
+	}
+}
+
+static void
+hist_evict(struct buf_hist *h)
+{
+	// the most recent operation is always kept, even if it alone goes
+	// over budget.
+	while (h->nbytes > CONF_HIST_BUDGET && h->size > 1)
+	{
+		struct buf_op *op = hist_at(h, 0);
+		h->nbytes -= op_cost(op);
+		hist_release(h, op);
+		
+		h->first = (h->first + 1) % h->cap;
+		--h->size;
+		--h->cur;
+		
+		// anything older on disk no longer connects to what is left.
+		hist_file_close(&h->file);
+	}
+}
+
+static void
+hist_clear(struct buf_hist *h)
+{
+	for (size_t i = 0; i < h->size; ++i)
+		hist_release(h, hist_at(h, i));
+	
+	h->first = h->size = h->cur = 0;
+	h->nbytes = 0;
+	h->sealed = false;
+	hist_file_close(&h->file);
+}
+
+static wchar_t *
+hist_alloc(struct buf_hist *h,
+           size_t n,
+           size_t slack,
+           struct hist_chunk **out_chunk)
+{
+	struct hist_chunk *top = h->top;
+	if (!top || top->cap - top->used < n + slack)
+	{
+		// a chunk is freed once none of its payloads are in use anymore,
+		// which for the top chunk can only be checked once it is
+		// replaced.
+		if (top && !top->nlive)
+			free(top);
+		
+		size_t cap = MAX(HIST_CHUNK_SIZE, n + slack);
+		top = malloc(sizeof(struct hist_chunk) + sizeof(wchar_t) * cap);
+		top->used = 0;
+		top->cap = cap;
+		top->nlive = 0;
+		h->top = top;
+	}
+	
+	wchar_t *data = top->data + top->used;
+	top->used += n;
+	++top->nlive;
+	*out_chunk = top;
+	
+	return data;
+}
+
+static void
+hist_release(struct buf_hist *h, struct buf_op *op)
+{
+	if (!op->data)
+		return;
+	
+	if (!--op->chunk->nlive && op->chunk != h->top)
+		free(op->chunk);
+	
+	op->data = NULL;
+	op->chunk = NULL;
+}
+
+static size_t
+op_cost(struct buf_op const *op)
+{
+	size_t data_size = op->data ? sizeof(wchar_t) * (op->ub - op->lb + 1) : 0;
+	return sizeof(struct buf_op) + data_size;
+}
+
+static void
+mv_gap(struct buf *b, size_t pos)
+{
+	// only the text between the old and new gap positions is moved, so
+	// sequential edits in the same area are cheap regardless of buffer
+	// size.
+	uint8_t *conts = b->conts;
+	size_t w = b->width;
+	
+	if (pos < b->gap_pos)
+	{
+		memmove(conts + w * (pos + b->gap_size),
+		        conts + w * pos,
+		        w * (b->gap_pos - pos));
+	}
+	else if (pos > b->gap_pos)
+	{
+		memmove(conts + w * b->gap_pos,
+		        conts + w * (b->gap_pos + b->gap_size),
+		        w * (pos - b->gap_pos));
+	}
+	
+	b->gap_pos = pos;
+}
+
+static void
+grow_gap(struct buf *b, size_t n)
+{
+	if (b->gap_size >= n)
+		return;
+	
+	size_t newcap = b->cap;
+	while (newcap - b->size < n)
+		newcap *= 2;
+	
+	size_t ntail = b->size - b->gap_pos;
+	size_t newgap = newcap - b->size;
+	
+	size_t w = b->width;
+	
+	b->conts = realloc(b->conts, w * newcap);
+	uint8_t *conts = b->conts;
+	memmove(conts + w * (b->gap_pos + newgap),
+	        conts + w * (b->gap_pos + b->gap_size),
+	        w * ntail);
+	
+	b->cap = newcap;
+	b->gap_size = newgap;
+}
+
+static void
+ins_gap(struct buf *b, size_t ind, wchar_t const *wstr, size_t len)
+{
+	if (b->share)
+		unshare_conts(b);
+	
+	widen(b, need_width(wstr, len));
+	mv_gap(b, ind);
+	grow_gap(b, len);
+	
+	raw_write(b->conts, b->width, b->gap_pos, wstr, len);
+	b->gap_pos += len;
+	b->gap_size -= len;
+}
+
+static unsigned char
+need_width(wchar_t const *wstr, size_t len)
+{
+	uint32_t bits = 0;
+	for (size_t i = 0; i < len; ++i)
+		bits |= (uint32_t)wstr[i];
+	
+	return bits <= 0xff ? 1 : bits <= 0xffff ? 2 : 4;
+}
+
+static void
+widen(struct buf *b, unsigned char width)
+{
+	if (width <= b->width)
+		return;
+	
+	// the text on either side of the gap is converted; the gap itself
+	// holds nothing worth keeping.
+	void *new = malloc(width * b->cap);
+	size_t tail = b->gap_pos + b->gap_size;
+	
+	wchar_t *tmp = malloc(sizeof(wchar_t) * MAX(b->gap_pos, b->cap - tail));
+	raw_read(b->conts, b->width, tmp, 0, b->gap_pos);
+	raw_write(new, width, 0, tmp, b->gap_pos);
+	raw_read(b->conts, b->width, tmp, tail, b->cap - tail);
+	raw_write(new, width, tail, tmp, b->cap - tail);
+	free(tmp);
+	
+	free(b->conts);
+	b->conts = new;
+	b->width = width;
+	
+	log_mem(b);
+}
+
+static void
+log_mem(struct buf const *b)
+{
+	if (!flag_d || b->store != BS_GAP)
+		return;
+	
+	fprintf(stderr,
+	        "buf: %s: %zu chars at %u bytes each, %zu bytes saved over wchar_t\n",
+	        b->src ? (char *)b->src : "(fresh)",
+	        b->size,
+	        (unsigned)b->width,
+	        (sizeof(wchar_t) - b->width) * b->cap);
+}
+
+static wchar_t
+raw_get(void const *conts, unsigned char width, size_t ind)
+{
+	switch (width)
+	{
+	case 1:
+		return ((uint8_t const *)conts)[ind];
+	case 2:
+		return ((uint16_t const *)conts)[ind];
+	default:
+		return ((uint32_t const *)conts)[ind];
+	}
+}
+
+static void
+raw_read(void const *conts,
+         unsigned char width,
+         wchar_t *dst,
+         size_t ind,
+         size_t n)
+{
+	// kept as separate loops per width so that each can be vectorized.
+	switch (width)
+	{
+	case 1:
+		for (size_t i = 0; i < n; ++i)
+			dst[i] = ((uint8_t const *)conts)[ind + i];
+		break;
+	case 2:
+		for (size_t i = 0; i < n; ++i)
+			dst[i] = ((uint16_t const *)conts)[ind + i];
+		break;
+	default:
+		memcpy(dst, (uint32_t const *)conts + ind, sizeof(wchar_t) * n);
+		break;
+	}
+}
+
+static void
+raw_write(void *conts,
+          unsigned char width,
+          size_t ind,
+          wchar_t const *src,
+          size_t n)
+{
+	switch (width)
+	{
+	case 1:
+		for (size_t i = 0; i < n; ++i)
+			((uint8_t *)conts)[ind + i] = src[i];
+		break;
+	case 2:
+		for (size_t i = 0; i < n; ++i)
+			((uint16_t *)conts)[ind + i] = src[i];
 		break;
+	default:
+		memcpy((uint32_t *)conts + ind, src, sizeof(wchar_t) * n);
+		break;
+	}
+}
+
+static void
+unshare_conts(struct buf *b)
+{
+	struct buf_share *sh = b->share;
+	b->share = NULL;
+	
+	// snapshots are only ever taken on the editing thread, so nothing new
+	// can start sharing the contents while this runs.
+	pthread_mutex_lock(&sh->lock);
+	bool alone = sh->refs == 1;
+	pthread_mutex_unlock(&sh->lock);
+	
+	if (alone)
+	{
+		pthread_mutex_destroy(&sh->lock);
+		free(sh);
+		return;
 	}
+	
+	// the copy has to be made before letting go of the shared contents,
+	// as the last snapshot could otherwise free them underneath it.
+	size_t n = b->width * b->cap;
+	void *conts = malloc(n);
+	memcpy(conts, b->conts, n);
+	b->conts = conts;
+	
+	release_share(sh);
+}
+
+static void
+release_share(struct buf_share *sh)
+{
+	pthread_mutex_lock(&sh->lock);
+	bool last = --sh->refs == 0;
+	pthread_mutex_unlock(&sh->lock);
+	
+	if (last)
+	{
+		free(sh->conts);
+		pthread_mutex_destroy(&sh->lock);
+		free(sh);
 	}
 }
+
+static void
+wake_init(void)
+{
+	// only ever called on the editing thread, before any job that could
+	// write to the pipe is started.
+	// without a pipe, finished jobs are only noticed once something else
+	// happens.
+	if (wake_fds[0] == -1 && pipe2(wake_fds, O_NONBLOCK | O_CLOEXEC))
+		wake_fds[0] = wake_fds[1] = -1;
+}
+
+static void
+wake(void)
+{
+	// a full pipe already has the editor waking up, so a failed write
+	// loses nothing.
+	uint8_t byte = 0;
+	if (wake_fds[1] != -1)
+		write(wake_fds[1], &byte, 1);
+}
+
+static void *
+load_worker(void *arg)
+{
+	struct buf_load_job *job = arg;
+	job->bad_utf8 = load_file(&job->loaded, job->fd, job->stat_ok, job->size, &job->bad_off);
+	job->hash = content_hash(&job->loaded);
+	job->len = job->loaded.size;
+	wake();
+	return NULL;
+}
+
+static void
+swap_store(struct buf *a, struct buf *b)
+{
+	struct buf tmp = *a;
+	
+	a->conts = b->conts;
+	a->width = b->width;
+	a->pt = b->pt;
+	a->store = b->store;
+	a->size = b->size;
+	a->cap = b->cap;
+	a->gap_pos = b->gap_pos;
+	a->gap_size = b->gap_size;
+	a->lines = b->lines;
+	a->share = b->share;
+	
+	b->conts = tmp.conts;
+	b->width = tmp.width;
+	b->pt = tmp.pt;
+	b->store = tmp.store;
+	b->size = tmp.size;
+	b->cap = tmp.cap;
+	b->gap_pos = tmp.gap_pos;
+	b->gap_size = tmp.gap_size;
+	b->lines = tmp.lines;
+	b->share = tmp.share;
+}
+
+static void
+show_bad_utf8(char const *path, size_t off)
+{
+	size_t msg_len = sizeof(wchar_t) * (strlen(path) + 64);
+	wchar_t *msg = malloc(msg_len);
+	swprintf(msg, msg_len, L"file contains invalid UTF-8 at byte %zu: %s!", off, path);
+	prompt_show(msg);
+	free(msg);
+}
+
+static void
+record_src(struct buf *b, struct stat const *s)
+{
+	b->src_mtime = s->st_mtim;
+	b->src_size = s->st_size;
+}
+
+static uint64_t *
+hash_lines(struct buf const *b, size_t *out_n)
+{
+	size_t n = 0, cap = 64;
+	uint64_t *hashes = malloc(sizeof(uint64_t) * cap);
+	
+	// the contents are read in blocks rather than line by line, so that
+	// snapshots, which have no line index, can be hashed as well.
+	// lines are hashed along with their newlines, so that a missing
+	// newline at the end of the file still counts as a change.
+	wchar_t *blk = malloc(sizeof(wchar_t) * (LINE_HASH_BLK_SIZE + 1));
+	uint64_t hash = 0xcbf29ce484222325;
+	for (size_t off = 0;; off += LINE_HASH_BLK_SIZE)
+	{
+		size_t len = b->size - off < LINE_HASH_BLK_SIZE ? b->size - off : LINE_HASH_BLK_SIZE;
+		buf_get_wstr(b, blk, off, len + 1);
+		
+		// the last line is pushed along with the last block, even if it
+		// is empty.
+		for (size_t i = 0; i < len + (off + len == b->size); ++i)
+		{
+			if (i < len)
+			{
+				hash ^= (uint32_t)blk[i];
+				hash *= 0x100000001b3;
+				if (blk[i] != L'\n')
+					continue;
+			}
+			
+			if (n == cap)
+			{
+				cap *= 2;
+				hashes = realloc(hashes, sizeof(uint64_t) * cap);
+			}
+			hashes[n++] = hash;
+			hash = 0xcbf29ce484222325;
+		}
+		
+		if (off + len == b->size)
+			break;
+	}
+	
+	free(blk);
+	
+	*out_n = n;
+	return hashes;
+}
+
+static size_t
+line_off(struct buf const *b, size_t ln)
+{
+	return ln < buf_line_cnt(b) ? buf_line_start(b, ln) : b->size;
+}
+
+static void
+replace_all(struct buf *b, struct buf *new)
+{
+	// the history refers to positions in the old contents, which no longer
+	// mean anything.
+	size_t old_size = b->size;
+	swap_store(b, new);
+	hist_clear(&b->hist);
+	
+	mark_tree_erase(&b->marks, 0, old_size);
+	mark_tree_insert(&b->marks, 0, b->size);
+	publish(b, 0, old_size, b->size);
+	
+	b->flags &= ~BF_MODIFIED;
+	b->saved_hash = content_hash(b);
+	b->saved_len = b->size;
+}
+
+static bool
+merge_hunks(struct diff_hunk const *ours,
+            size_t nours,
+            struct diff_hunk const *theirs,
+            size_t ntheirs,
+            enum buf_merge_mode mode,
+            struct diff_hunk *out,
+            size_t *out_n)
+{
+	// both sets of hunks are against the same old lines, and are grouped
+	// into regions of them, with hunks that overlap or touch ending up in
+	// the same region.
+	// the end of the last hunk seen on either side is kept in both the
+	// old lines and its own, as lines between hunks map across unchanged.
+	size_t ours_old = 0, ours_new = 0;
+	size_t theirs_old = 0, theirs_new = 0;
+	bool conflict = false;
+	
+	*out_n = 0;
+	for (size_t i = 0, j = 0; j < ntheirs;)
+	{
+		// regions edited only in the buffer are left alone.
+		if (i < nours && ours[i].a_start + ours[i].a_len < theirs[j].a_start)
+		{
+			ours_old = ours[i].a_start + ours[i].a_len;
+			ours_new = ours[i].b_start + ours[i].b_len;
+			++i;
+			continue;
+		}
+		
+		size_t lb = theirs[j].a_start;
+		if (i < nours && ours[i].a_start < lb)
+			lb = ours[i].a_start;
+		
+		size_t buf_lb = ours_new + (lb - ours_old);
+		size_t file_lb = theirs_new + (lb - theirs_old);
+		
+		size_t ub = lb;
+		bool edited = false;
+		for (bool grown = true; grown;)
+		{
+			grown = false;
+			if (i < nours && ours[i].a_start <= ub)
+			{
+				if (ours[i].a_start + ours[i].a_len > ub)
+					ub = ours[i].a_start + ours[i].a_len;
+				ours_old = ours[i].a_start + ours[i].a_len;
+				ours_new = ours[i].b_start + ours[i].b_len;
+				++i;
+				edited = grown = true;
+			}
+			
+			if (j < ntheirs && theirs[j].a_start <= ub)
+			{
+				if (theirs[j].a_start + theirs[j].a_len > ub)
+					ub = theirs[j].a_start + theirs[j].a_len;
+				theirs_old = theirs[j].a_start + theirs[j].a_len;
+				theirs_new = theirs[j].b_start + theirs[j].b_len;
+				++j;
+				grown = true;
+			}
+		}
+		
+		conflict = conflict || edited;
+		if (edited && mode != BMM_TAKE_FILE)
+			continue;
+		
+		size_t buf_ub = ours_new + (ub - ours_old);
+		size_t file_ub = theirs_new + (ub - theirs_old);
+		out[(*out_n)++] = (struct diff_hunk)
+		{
+			.a_start = buf_lb,
+			.a_len = buf_ub - buf_lb,
+			.b_start = file_lb,
+			.b_len = file_ub - file_lb,
+		};
+	}
+	
+	return conflict;
+}
+
+static void
+apply_hunks(struct buf *b,
+            struct buf const *new,
+            struct diff_hunk const *hunks,
+            size_t nhunks)
+{
+	// only the lines that actually differ are edited, so that marks on
+	// the rest of the buffer stay where they are, and the changes can be
+	// undone like any other edit.
+	buf_push_hist_brk(b);
+	
+	// hunks are applied back to front, which leaves the positions of the
+	// lines before each one unchanged.
+	for (size_t i = nhunks; i-- > 0;)
+	{
+		struct diff_hunk const *h = &hunks[i];
+		size_t lb = line_off(b, h->a_start);
+		size_t ub = line_off(b, h->a_start + h->a_len);
+		size_t new_lb = line_off(new, h->b_start);
+		size_t new_ub = line_off(new, h->b_start + h->b_len);
+		
+		// the new lines go in before the old ones are erased, so that
+		// marks right after the hunk don't end up at its start.
+		size_t len = new_ub - new_lb;
+		if (len)
+		{
+			wchar_t *wstr = malloc(sizeof(wchar_t) * (len + 1));
+			buf_get_wstr(new, wstr, new_lb, len + 1);
+			buf_write_wstr(b, lb, wstr);
+			free(wstr);
+		}
+		
+		if (ub > lb)
+			buf_erase(b, lb + len, ub + len);
+	}
+	
+	buf_push_hist_brk(b);
+}
+
+static void
+journal_diff(struct buf *b, struct buf const *file)
+{
+	// the journal holds whatever turns the file into the buffer, so the
+	// lines that differ are recorded as if they had been edited one after
+	// the other, back to front.
+	// the file has just been merged, so its lines are those of the base.
+	size_t nbuf;
+	uint64_t *hbuf = hash_lines(b, &nbuf);
+	
+	struct diff_hunk *hunks;
+	size_t nhunks = diff_lines(b->base_lines, b->nbase_lines, hbuf, nbuf, CONF_RELOAD_MAX_DIFF, &hunks);
+	free(hbuf);
+	
+	for (size_t i = nhunks; i-- > 0;)
+	{
+		struct diff_hunk const *h = &hunks[i];
+		size_t lb = line_off(file, h->a_start);
+		size_t ub = line_off(file, h->a_start + h->a_len);
+		size_t buf_lb = line_off(b, h->b_start);
+		size_t len = line_off(b, h->b_start + h->b_len) - buf_lb;
+		
+		if (ub > lb)
+			track_erase(b, lb, ub);
+		if (len)
+		{
+			wchar_t *wstr = malloc(sizeof(wchar_t) * (len + 1));
+			buf_get_wstr(b, wstr, buf_lb, len + 1);
+			track_write(b, lb, wstr, len);
+			free(wstr);
+		}
+	}
+	
+	free(hunks);
+}
+
+static struct buf
+open_file(char const *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+	{
+		size_t msg_len = sizeof(wchar_t) * (strlen(path) + 20);
+		wchar_t *msg = malloc(msg_len);
+		swprintf(msg, msg_len, L"cannot read file: %s!", path);
+		prompt_show(msg);
+		free(msg);
+		return buf_create(false);
+	}
+	
+	struct buf b = buf_create(true);
+	b.flags = BF_WRITABLE | BF_NO_HIST;
+	b.src_type = BST_FILE;
+	b.src = strdup(path);
+	
+	// the history file is only mapped here, and nothing is read from it
+	// until it is undone into.
+	if (CONF_UNDO_PERSIST)
+		hist_file_open(path, &b.hist.file);
+	
+	struct stat s;
+	bool stat_ok = !fstat(fileno(fp), &s);
+	if (stat_ok)
+		record_src(&b, &s);
+	
+	int ea = euidaccess(path, W_OK);
+	uint8_t flags = (!ea && !flag_r) * BF_WRITABLE;
+	
+	// large files are shown as soon as their start has been decoded, and
+	// the rest is loaded in the background.
+	// the worker gets its own descriptor, as the file is closed here.
+	struct buf_load_job *job = NULL;
+	if (stat_ok && s.st_size > CONF_LOAD_HEAD_SIZE)
+	{
+		job = malloc(sizeof(struct buf_load_job));
+		job->loaded = buf_create(true);
+		job->loaded.flags = BF_WRITABLE | BF_NO_HIST;
+		job->fd = dup(fileno(fp));
+		job->stat_ok = stat_ok;
+		job->size = s.st_size;
+		job->flags = flags;
+		
+		wake_init();
+		if (job->fd == -1 || pthread_create(&job->thread, NULL, load_worker, job))
+		{
+			if (job->fd != -1)
+				close(job->fd);
+			buf_destroy(&job->loaded);
+			free(job);
+			job = NULL;
+		}
+	}
+	
+	if (job)
+	{
+		load_head(&b, fileno(fp));
+		b.load_job = job;
+	}
+	else
+	{
+		size_t bad_off;
+		if (load_file(&b, fileno(fp), stat_ok, stat_ok ? s.st_size : 0, &bad_off))
+			show_bad_utf8(path, bad_off);
+		b.saved_hash = content_hash(&b);
+		b.saved_len = b.size;
+	}
+	
+	fclose(fp);
+	
+	if (ea != 0 || flag_r)
+	{
+		size_t msg_len = sizeof(wchar_t) * (strlen(path) + 24);
+		wchar_t *msg = malloc(msg_len);
+		swprintf(msg, msg_len, L"opening file readonly: %s", path);
+		prompt_show(msg);
+		free(msg);
+	}
+	
+	b.flags = job ? BF_LOADING : flags;
+	
+	return b;
+}
+
+static void
+recover(struct buf *b)
+{
+	// buffers which can't be edited are left alone, and so is their
+	// journal, which can then be recovered later on.
+	if (b->src_type != BST_FILE || !(b->flags & BF_WRITABLE))
+		return;
+	
+	struct journal_rec *recs;
+	size_t nrecs;
+	switch (journal_load(b->src, b->src_mtime, b->src_size, &recs, &nrecs))
+	{
+	case JS_OK:
+		break;
+	case JS_NONE:
+		return;
+	case JS_STALE:
+	{
+		size_t msg_len = sizeof(wchar_t) * (strlen(b->src) + 48);
+		wchar_t *msg = malloc(msg_len);
+		swprintf(msg, msg_len, L"discarding outdated edit journal: %s!", (char *)b->src);
+		prompt_show(msg);
+		free(msg);
+		
+		journal_discard(b->src);
+		return;
+	}
+	}
+	
+	int confirm = 1;
+	if (nrecs)
+	{
+		size_t msg_len = sizeof(wchar_t) * (strlen(b->src) + 48);
+		wchar_t *msg = malloc(msg_len);
+		swprintf(msg, msg_len, L"found unsaved edits to %s! recover them?", (char *)b->src);
+		confirm = prompt_yes_no(msg, true);
+		free(msg);
+	}
+	
+	// cancelling keeps the journal around for next time.
+	if (confirm == 0 || !nrecs)
+		journal_discard(b->src);
+	else if (confirm == 1)
+	{
+		// recovered edits are replayed like any others, so that they
+		// can be undone and end up in a new journal of their own.
+		// replaying stops at the first edit that doesn't fit, which
+		// only happens if the journal was damaged.
+		buf_push_hist_brk(b);
+		for (size_t i = 0; i < nrecs; ++i)
+		{
+			struct journal_rec const *r = &recs[i];
+			if (r->lb > b->size || r->ub > b->size)
+				break;
+			
+			if (r->wstr)
+				buf_write_wstr(b, r->lb, r->wstr);
+			else
+				buf_erase(b, r->lb, r->ub);
+		}
+		buf_push_hist_brk(b);
+	}
+	
+	journal_free_recs(recs, nrecs);
+}
+
+static void
+track_write(struct buf *b, size_t ind, wchar_t const *wstr, size_t len)
+{
+	// the journal is opened lazily, so that files which are only ever
+	// looked at never get one.
+	if (b->src_type != BST_FILE || b->flags & BF_NO_JOURNAL)
+		return;
+	
+	if (!b->journal)
+		b->journal = journal_open(b->src, b->src_mtime, b->src_size);
+	journal_write(b->journal, ind, wstr, len);
+}
+
+static void
+track_erase(struct buf *b, size_t lb, size_t ub)
+{
+	if (b->src_type != BST_FILE || b->flags & BF_NO_JOURNAL)
+		return;
+	
+	if (!b->journal)
+		b->journal = journal_open(b->src, b->src_mtime, b->src_size);
+	journal_erase(b->journal, lb, ub);
+}
+
+static int
+load_hist(struct buf *b)
+{
+	struct buf_hist *h = &b->hist;
+	if (!h->file.map || !(b->flags & BF_WRITABLE))
+		return 1;
+	
+	// records are read back from the newest, and put in front of the
+	// oldest operation in memory.
+	// keys can only be checked once everything after them has been
+	// undone, so reading stops at one unless that is already the case.
+	size_t nloaded = 0;
+	struct hist_rec rec;
+	while (nloaded < CONF_UNDO_LOAD_BATCH && !hist_file_peek(&h->file, &rec))
+	{
+		if (rec.type == HRT_KEY)
+		{
+			if (nloaded)
+				break;
+			
+			if (content_hash(b) != rec.key)
+			{
+				hist_file_close(&h->file);
+				break;
+			}
+			
+			hist_file_pop(&h->file);
+			continue;
+		}
+		
+		struct buf_op op =
+		{
+			.type = rec.type == HRT_WRITE ? BOT_WRITE : rec.type == HRT_ERASE ? BOT_ERASE : BOT_BRK,
+			.data = NULL,
+			.chunk = NULL,
+			.lb = rec.lb,
+			.ub = rec.ub,
+		};
+		
+		// erased text is stored back to front, see `push_hist()`.
+		if (op.type == BOT_ERASE)
+		{
+			size_t n = op.ub - op.lb;
+			op.data = hist_alloc(h, n, 0, &op.chunk);
+			if (hist_file_decode(&rec, op.data) != n)
+			{
+				hist_release(h, &op);
+				hist_file_close(&h->file);
+				break;
+			}
+			
+			for (size_t i = 0; i < n / 2; ++i)
+			{
+				wchar_t tmp = op.data[i];
+				op.data[i] = op.data[n - 1 - i];
+				op.data[n - 1 - i] = tmp;
+			}
+		}
+		
+		if (h->size == h->cap)
+		{
+			struct buf_op *new_ops = malloc(sizeof(struct buf_op) * 2 * h->cap);
+			for (size_t i = 0; i < h->size; ++i)
+				new_ops[i] = *hist_at(h, i);
+			
+			free(h->ops);
+			h->ops = new_ops;
+			h->first = 0;
+			h->cap *= 2;
+		}
+		
+		h->first = (h->first + h->cap - 1) % h->cap;
+		h->ops[h->first] = op;
+		++h->size;
+		++h->cur;
+		h->nbytes += op_cost(&op);
+		
+		hist_file_pop(&h->file);
+		nloaded += op.type != BOT_BRK;
+	}
+	
+	if (hist_file_peek(&h->file, &rec))
+		hist_file_close(&h->file);
+	
+	return !nloaded;
+}
+
+static void
+snap_hist(struct buf *b, struct buf_save_job *job)
+{
+	// whatever older history was never read back is only copied here, as
+	// the mapping it lives in can go away once editing carries on.
+	struct buf_hist *h = &b->hist;
+	if (h->file.end <= CONF_UNDO_FILE_BUDGET)
+		hist_file_put_raw(&job->hist, &h->file);
+	
+	// an empty history still needs to be written, so that it replaces
+	// any older one which no longer matches the file.
+	if (!job->hist.bytes)
+		job->hist.bytes = malloc(1);
+	
+	// only operations which have been applied are saved.
+	// payloads are never changed once written, only appended to, so the
+	// worker can read the copied ranges while editing goes on.
+	job->nops = h->cur;
+	job->ops = malloc(sizeof(struct buf_op) * MAX(job->nops, 1));
+	for (size_t i = 0; i < job->nops; ++i)
+	{
+		job->ops[i] = *hist_at(h, i);
+		if (job->ops[i].data)
+			++job->ops[i].chunk->nlive;
+	}
+}
+
+static void
+release_hist_snap(struct buf *b, struct buf_save_job *job)
+{
+	for (size_t i = 0; i < job->nops; ++i)
+		hist_release(&b->hist, &job->ops[i]);
+	free(job->ops);
+}
+
+static void
+enc_hist(struct buf_save_job *job)
+{
+	for (size_t i = 0; i < job->nops; ++i)
+	{
+		struct buf_op const *op = &job->ops[i];
+		struct hist_rec rec =
+		{
+			.type = op->type == BOT_WRITE ? HRT_WRITE : op->type == BOT_ERASE ? HRT_ERASE : HRT_BRK,
+			.lb = op->lb,
+			.ub = op->ub,
+		};
+		hist_file_put(&job->hist, &rec, op->data);
+	}
+}
+
+static uint64_t
+content_hash(struct buf *b)
+{
+	uint64_t hash;
+	line_idx_hash(&b->lines, SIZE_MAX, read_conts, b, &hash);
+	return hash;
+}
+
+static void
+refresh_modified(struct buf *b)
+{
+	// text of a different length can't be the same, so hashing is left
+	// until lengths match, which keeps repeated edits of a single long
+	// line cheap.
+	// then, only the parts of the text which changed since the last hash
+	// are hashed again, unless there is too much of it, in which case the
+	// buffer is just assumed to differ.
+	uint64_t hash;
+	if (b->size != b->saved_len
+	    || line_idx_hash(&b->lines, CONF_MOD_REHASH_MAX, read_conts, b, &hash)
+	    || hash != b->saved_hash)
+	{
+		b->flags |= BF_MODIFIED;
+	}
+	else
+		b->flags &= ~BF_MODIFIED;
+}
+
+static void
+read_conts(void const *ctx, wchar_t *dst, size_t pos, size_t n)
+{
+	buf_get_wstr(ctx, dst, pos, n + 1);
+}
+
+static void *
+save_worker(void *arg)
+{
+	struct buf_save_job *job = arg;
+	job->rc = save_atomic(&job->snap, job->path);
+	if (!job->rc && stat(job->path, &job->st))
+		job->rc = 1;
+	
+	if (!job->rc && job->snap.store == BS_GAP)
+		job->base_lines = hash_lines(&job->snap, &job->nbase_lines);
+	
+	// the history ends with a key for the saved contents, so that it is
+	// only ever used on top of them.
+	if (!job->rc && job->hist.bytes)
+	{
+		enc_hist(job);
+		
+		struct hist_rec key =
+		{
+			.type = HRT_KEY,
+			.key = job->hash,
+		};
+		hist_file_put(&job->hist, &key, NULL);
+		if (hist_file_write(job->path, &job->hist) && flag_d)
+			fprintf(stderr, "buf: failed to save undo history for %s\n", job->path);
+	}
+	
+	wake();
+	return NULL;
+}
+
+static int
+save_atomic(struct buf const *snap, char const *path)
+{
+	// the contents are written to a temporary file in the same directory,
+	// which then replaces the original.
+	// this way, a crash mid-save never leaves a truncated file behind,
+	// and any mapping of the original file stays valid.
+	size_t tmp_len = strlen(path) + 8;
+	char *tmp = malloc(tmp_len);
+	snprintf(tmp, tmp_len, "%s.XXXXXX", path);
+	
+	int fd = mkstemp(tmp);
+	if (fd == -1)
+	{
+		free(tmp);
+		return 1;
+	}
+	
+	struct stat s;
+	if (!stat(path, &s))
+		fchmod(fd, s.st_mode & 07777);
+	
+	if (write_conts(snap, fd, path) || fsync(fd))
+	{
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return 1;
+	}
+	
+	if (close(fd) || rename(tmp, path))
+	{
+		unlink(tmp);
+		free(tmp);
+		return 1;
+	}
+	
+	free(tmp);
+	
+	// the rename itself is only durable once the directory is synced.
+	char *dir = strdup(path);
+	char *slash = strrchr(dir, '/');
+	if (slash == dir)
+		slash[1] = 0;
+	else if (slash)
+		*slash = 0;
+	
+	int dir_fd = open(slash ? dir : ".", O_RDONLY | O_DIRECTORY);
+	if (dir_fd != -1)
+	{
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+	
+	free(dir);
+	
+	return 0;
+}
+
+static int
+write_conts(struct buf const *b, int fd, char const *path)
+{
+	// contents are encoded a block at a time into one large buffer, which
+	// is then written out with as few calls as possible.
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	wchar_t *wcs = malloc(sizeof(wchar_t) * (CONF_SAVE_BLK_SIZE + 1));
+	uint8_t *bytes = malloc(4 * CONF_SAVE_BLK_SIZE);
+	size_t nbytes_total = 0;
+	int rc = 0;
+	
+	for (size_t i = 0; i < b->size; i += CONF_SAVE_BLK_SIZE)
+	{
+		size_t n = MIN(CONF_SAVE_BLK_SIZE, b->size - i);
+		buf_get_wstr(b, wcs, i, n + 1);
+		
+		size_t nbytes = utf8_encode_buf(bytes, (uchar32 *)wcs, n);
+		if (write_all(fd, bytes, nbytes))
+		{
+			rc = 1;
+			break;
+		}
+		
+		nbytes_total += nbytes;
+	}
+	
+	free(wcs);
+	free(bytes);
+	
+	if (flag_d && !rc)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+		fprintf(stderr,
+		        "buf: saved %zu bytes to %s in %.3fs (%.1f MB/s)\n",
+		        nbytes_total,
+		        path,
+		        secs,
+		        secs > 0.0 ? nbytes_total / secs / 1e6 : 0.0);
+	}
+	
+	return rc;
+}
+
+static void
+index_piece(struct buf *b)
+{
+	// the line index is built directly from the mapped bytes rather than
+	// through per-character lookups.
+	uint8_t const *bytes = b->pt.map;
+	size_t nbytes = b->pt.map_size;
+	
+	size_t nsegs = 0, segs_cap = 64;
+	size_t *segs = malloc(sizeof(size_t) * segs_cap);
+	
+	size_t seg = 0, nch = 0;
+	for (size_t i = 0; i < nbytes && nch < b->size; ++i)
+	{
+		// continuation bytes don't start a new character.
+		if ((bytes[i] & 0xc0) == 0x80)
+			continue;
+		
+		++seg;
+		++nch;
+		
+		if (bytes[i] == '\n')
+		{
+			if (nsegs + 1 >= segs_cap)
+			{
+				segs_cap *= 2;
+				segs = realloc(segs, sizeof(size_t) * segs_cap);
+			}
+			
+			segs[nsegs++] = seg;
+			seg = 0;
+		}
+	}
+	segs[nsegs++] = seg;
+	
+	line_idx_insert(&b->lines, 0, segs, nsegs);
+	free(segs);
+}
+
+static bool
+load_file(struct buf *b,
+          int fd,
+          bool stat_ok,
+          size_t size,
+          size_t *out_bad)
+{
+	// large files are mapped and edited through a piece table instead of
+	// being decoded up front.
+	if (stat_ok && size >= CONF_PIECE_THRESHOLD)
+	{
+		size_t valid;
+		if (!piece_tab_create(&b->pt, fd, size, &valid))
+		{
+			b->store = BS_PIECE;
+			b->size = b->pt.orig_len;
+			index_piece(b);
+			*out_bad = valid;
+			return valid < size;
+		}
+	}
+	
+	// mapped contents are never merged, so only decoded ones need their
+	// lines kept.
+	bool bad = load_gap(b, fd, size, out_bad);
+	b->base_lines = hash_lines(b, &b->nbase_lines);
+	
+	return bad;
+}
+
+static void
+load_head(struct buf *b, int fd)
+{
+	// only the valid prefix of the head is decoded, as the background load
+	// reports any invalid UTF-8 once it finishes.
+	uint8_t *blk = malloc(CONF_LOAD_HEAD_SIZE);
+	ssize_t nread = pread(fd, blk, CONF_LOAD_HEAD_SIZE, 0);
+	
+	wchar_t *dec = malloc(sizeof(wchar_t) * CONF_LOAD_HEAD_SIZE);
+	size_t nch = 0;
+	if (nread > 0)
+		utf8_decode_buf((uchar32 *)dec, blk, nread, &nch);
+	
+	ins_gap(b, 0, dec, nch);
+	line_idx_insert_wstr(&b->lines, 0, dec, nch);
+	b->size = nch;
+	
+	free(blk);
+	free(dec);
+}
+
+static int
+load_gap(struct buf *b, int fd, size_t size_hint, size_t *out_bad)
+{
+	// the file is read and decoded in large blocks straight into the gap,
+	// which is sized for the whole file up front.
+	// a file never has more characters than bytes, so this is enough
+	// unless the file grows while being read.
+	// blocks are decoded into wide characters first, then narrowed down
+	// to the buffer's storage width.
+	b->cap = size_hint + 1;
+	b->gap_size = b->cap;
+	b->conts = realloc(b->conts, b->width * b->cap);
+	
+	uint8_t *blk = malloc(CONF_LOAD_BLK_SIZE);
+	wchar_t *dec = malloc(sizeof(wchar_t) * CONF_LOAD_BLK_SIZE);
+	size_t nblk = 0, off = 0;
+	int rc = 0;
+	
+	for (;;)
+	{
+		ssize_t nread = read(fd, blk + nblk, CONF_LOAD_BLK_SIZE - nblk);
+		if (nread < 0 && errno == EINTR)
+			continue;
+		
+		bool eof = nread <= 0;
+		nblk += eof ? 0 : nread;
+		
+		size_t nch;
+		size_t valid = utf8_decode_buf((uchar32 *)dec, blk, nblk, &nch);
+		
+		widen(b, need_width(dec, nch));
+		grow_gap(b, nch);
+		
+		raw_write(b->conts, b->width, b->gap_pos, dec, nch);
+		line_idx_insert_wstr(&b->lines, b->size, dec, nch);
+		b->gap_pos += nch;
+		b->gap_size -= nch;
+		b->size += nch;
+		
+		// a sequence may be split across two blocks, in which case its
+		// start is carried over into the next one.
+		size_t nrem = nblk - valid;
+		if (nrem && (eof || nrem >= (size_t)utf8_seq_len(blk[valid]) || !utf8_seq_len(blk[valid])))
+		{
+			*out_bad = off + valid;
+			rc = 1;
+			break;
+		}
+		
+		if (eof)
+			break;
+		
+		memmove(blk, blk + valid, nrem);
+		off += valid;
+		nblk = nrem;
+	}
+	
+	free(blk);
+	free(dec);
+	log_mem(b);
+	
+	return rc;
+}
+
+static void
+ins_text(struct buf *b, size_t ind, wchar_t const *wstr, size_t len)
+{
+	if (b->store == BS_PIECE)
+		piece_tab_insert(&b->pt, ind, wstr, len);
+	else
+		ins_gap(b, ind, wstr, len);
+	
+	line_idx_insert_wstr(&b->lines, ind, wstr, len);
+	mark_tree_insert(&b->marks, ind, len);
+	
+	b->size += len;
+	refresh_modified(b);
+	push_hist(b, BOT_WRITE, ind, ind + len);
+	track_write(b, ind, wstr, len);
+	publish(b, ind, 0, len);
+}
+
+static void
+txn_pend(struct buf *b, size_t ind, wchar_t const *wstr, size_t len)
+{
+	// only a single run of text is held back at a time, so a write
+	// anywhere else first applies what came before it.
+	if (b->txn_len && ind != b->txn_pos + b->txn_len)
+		txn_flush(b);
+	
+	if (!b->txn_len)
+		b->txn_pos = ind;
+	
+	if (b->txn_len + len > b->txn_cap)
+	{
+		b->txn_cap = MAX(2 * b->txn_cap, b->txn_len + len);
+		b->txn_ins = realloc(b->txn_ins, sizeof(wchar_t) * b->txn_cap);
+	}
+	
+	memcpy(b->txn_ins + b->txn_len, wstr, sizeof(wchar_t) * len);
+	b->txn_len += len;
+}
+
+static void
+txn_flush(struct buf *b)
+{
+	if (!b->txn_len)
+		return;
+	
+	// cleared first, as inserting can reenter the buffer through its
+	// listeners.
+	size_t len = b->txn_len;
+	b->txn_len = 0;
+	ins_text(b, b->txn_pos, b->txn_ins, len);
+}
@@ -48,6 +48,7 @@ int const conf_bind_focus[] = {K_CTL('l'), -1};
 int const conf_bind_kill[] = {K_CTL('k'), -1};
 int const conf_bind_paste[] = {K_CTL('y'), -1};
 int const conf_bind_undo[] = {K_CTL('x'), 'u', -1};
+int const conf_bind_redo[] = {K_CTL('x'), 'r', -1};
 int const conf_bind_copy[] = {K_CTL('c'), K_SPC, K_META('w'), -1};
 int const conf_bind_ncopy[] = {K_CTL('c'), K_SPC, K_META('n'), -1};
 int const conf_bind_find_lit[] = {K_CTL('s'), 'l', -1};
@@ -0,0 +1,169 @@
+#include "diff.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+struct move
+{
+	size_t x, y;
+	bool ins;
+};
+
+size_t
+diff_lines(uint64_t const *a,
+           size_t na,
+           uint64_t const *b,
+           size_t nb,
+           size_t max_cost,
+           struct diff_hunk **out)
+{
+	// lines are compared by their hashes only.
+	// the common start and end of both texts are skipped before diffing,
+	// as most changes only touch a small part of a file.
+	size_t pre = 0;
+	while (pre < na && pre < nb && a[pre] == b[pre])
+		++pre;
+	
+	size_t suf = 0;
+	while (suf < na - pre && suf < nb - pre && a[na - 1 - suf] == b[nb - 1 - suf])
+		++suf;
+	
+	a += pre;
+	b += pre;
+	na -= pre + suf;
+	nb -= pre + suf;
+	
+	*out = NULL;
+	if (na == 0 && nb == 0)
+		return 0;
+	
+	// the greedy algorithm of Myers is used, keeping the furthest reaching
+	// paths of every step around so that the edit script can be recovered.
+	// the paths of step d take up 2d + 1 entries, starting at d^2.
+	// diagonal indices go negative, so lengths are compared as signed.
+	ptrdiff_t len_a = na, len_b = nb;
+	ptrdiff_t max_d = MIN(na + nb, max_cost);
+	ptrdiff_t *v = malloc(sizeof(ptrdiff_t) * (2 * max_d + 3));
+	ptrdiff_t *v_mid = v + max_d + 1;
+	ptrdiff_t *trace = NULL;
+	size_t trace_cap = 0;
+	
+	ptrdiff_t found = -1;
+	v_mid[1] = 0;
+	for (ptrdiff_t d = 0; d <= max_d && found == -1; ++d)
+	{
+		for (ptrdiff_t k = -d; k <= d; k += 2)
+		{
+			ptrdiff_t x;
+			if (k == -d || (k != d && v_mid[k - 1] < v_mid[k + 1]))
+				x = v_mid[k + 1];
+			else
+				x = v_mid[k - 1] + 1;
+			
+			ptrdiff_t y = x - k;
+			while (x < len_a && y < len_b && a[x] == b[y])
+			{
+				++x;
+				++y;
+			}
+			
+			v_mid[k] = x;
+			if (x >= len_a && y >= len_b)
+			{
+				found = d;
+				break;
+			}
+		}
+		
+		size_t trace_len = (d + 1) * (d + 1);
+		if (trace_len > trace_cap)
+		{
+			trace_cap = 2 * trace_len;
+			trace = realloc(trace, sizeof(ptrdiff_t) * trace_cap);
+		}
+		memcpy(trace + d * d, v_mid - d, sizeof(ptrdiff_t) * (2 * d + 1));
+	}
+	
+	free(v);
+	
+	// texts differing too much are just replaced outright.
+	if (found == -1)
+	{
+		free(trace);
+		*out = malloc(sizeof(struct diff_hunk));
+		**out = (struct diff_hunk)
+		{
+			.a_start = pre,
+			.a_len = na,
+			.b_start = pre,
+			.b_len = nb,
+		};
+		return 1;
+	}
+	
+	// every step adds exactly one line, or removes exactly one line.
+	struct move *moves = malloc(sizeof(struct move) * MAX(found, 1));
+	ptrdiff_t x = len_a, y = len_b;
+	for (ptrdiff_t d = found; d > 0; --d)
+	{
+		ptrdiff_t const *prev = trace + (d - 1) * (d - 1) + d - 1;
+		ptrdiff_t k = x - y;
+		
+		bool ins = k == -d || (k != d && prev[k - 1] < prev[k + 1]);
+		ptrdiff_t prev_k = ins ? k + 1 : k - 1;
+		ptrdiff_t prev_x = prev[prev_k];
+		ptrdiff_t prev_y = prev_x - prev_k;
+		
+		moves[d - 1] = (struct move)
+		{
+			.x = prev_x,
+			.y = prev_y,
+			.ins = ins,
+		};
+		
+		x = prev_x;
+		y = prev_y;
+	}
+	
+	free(trace);
+	
+	// adjacent moves are merged into hunks.
+	struct diff_hunk *hunks = malloc(sizeof(struct diff_hunk) * MAX(found, 1));
+	size_t nhunks = 0;
+	for (ptrdiff_t i = 0; i < found; ++i)
+	{
+		struct move const *m = &moves[i];
+		struct diff_hunk *h = nhunks ? &hunks[nhunks - 1] : NULL;
+		
+		if (!h || m->x != h->a_start + h->a_len || m->y != h->b_start + h->b_len)
+		{
+			hunks[nhunks++] = (struct diff_hunk)
+			{
+				.a_start = m->x,
+				.a_len = 0,
+				.b_start = m->y,
+				.b_len = 0,
+			};
+			h = &hunks[nhunks - 1];
+		}
+		
+		if (m->ins)
+			++h->b_len;
+		else
+			++h->a_len;
+	}
+	
+	free(moves);
+	
+	for (size_t i = 0; i < nhunks; ++i)
+	{
+		hunks[i].a_start += pre;
+		hunks[i].b_start += pre;
+	}
+	
+	*out = hunks;
+	return nhunks;
+}
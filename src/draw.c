@@ -1,15 +1,23 @@
 #include "draw.h"
 
+#include <errno.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sys/ioctl.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include "conf.h"
+#include "utf8.h"
 #include "util.h"
 
+// roughly the number of bytes a cursor movement takes.
+#define CSR_JUMP_COST 6
+
 struct cell
 {
 	wchar_t wch;
@@ -17,18 +25,57 @@ struct cell
 };
 
 static void sigwinch_handler(int arg);
+static bool cell_eq(struct cell const *a, struct cell const *b);
+static void mv_csr(unsigned r, unsigned c);
+static void put_attr(uint8_t fg, uint8_t bg);
+static void put_cell(struct cell const *cell);
+static unsigned blank_tail(struct cell const *row);
+static uint8_t *out_reserve(size_t n);
+static void out_str(char const *str);
+static void out_uint(unsigned n);
+static void out_flush(void);
 
-static struct cell *cells;
+// `shown` holds what the terminal was last made to display, which refreshes
+// are diffed against, and is unknown while `stale` is set.
+static struct cell *cells, *shown;
+static bool stale;
 static struct winsize ws;
 
+// where output will next be written, and with what colors, as far as is
+// known.
+// `csr_c` is set past the screen when it isn't.
+static unsigned csr_r, csr_c;
+static uint8_t cur_fg, cur_bg;
+
+static size_t nbytes;
+
+// changed on every write to `cells`.
+static unsigned long gen = 0;
+
+// refreshes are assembled here, then written to the terminal all at once.
+static uint8_t *out;
+static size_t out_len, out_cap;
+
+// color sequences are formatted once up front, rather than on every use.
+static char fg_seqs[256][16], bg_seqs[256][16];
+
 void
 draw_init(void)
 {
-	fputws(L"\033[?25l", stdout);
+	for (unsigned i = 0; i < 256; ++i)
+	{
+		sprintf(fg_seqs[i], "\033[38;5;%um", i);
+		sprintf(bg_seqs[i], "\033[48;5;%um", i);
+	}
+	
+	out_str("\033[?25l");
+	out_flush();
 
 	ioctl(0, TIOCGWINSZ, &ws);
 	
 	cells = malloc(sizeof(struct cell) * ws.ws_row * ws.ws_col);
+	shown = malloc(sizeof(struct cell) * ws.ws_row * ws.ws_col);
+	stale = true;
 
 	struct sigaction sa;
 	sigaction(SIGWINCH, NULL, &sa);
@@ -40,7 +87,11 @@ void
 draw_quit(void)
 {
 	free(cells);
-	fputws(L"\033[?25h\033[0m", stdout);
+	free(shown);
+	
+	out_str("\033[?25h\033[0m");
+	out_flush();
+	free(out);
 }
 
 void
@@ -58,6 +109,8 @@ draw_fill(unsigned pr,
           uint8_t fg,
           uint8_t bg)
 {
+	++gen;
+	
 	for (size_t i = pr; i < pr + sr; ++i)
 	{
 		if (i >= ws.ws_row)
@@ -81,6 +134,8 @@ draw_fill(unsigned pr,
 void
 draw_put_wch(unsigned r, unsigned c, wchar_t wch)
 {
+	++gen;
+	
 	if (c >= ws.ws_col || r >= ws.ws_row)
 		return;
 	
@@ -90,6 +145,8 @@ draw_put_wch(unsigned r, unsigned c, wchar_t wch)
 void
 draw_put_wstr(unsigned r, unsigned c, wchar_t const *wstr)
 {
+	++gen;
+	
 	for (wchar_t const *wc = wstr; *wc; ++wc)
 	{
 		if (*wc != L'\n')
@@ -112,6 +169,8 @@ draw_put_wstr(unsigned r, unsigned c, wchar_t const *wstr)
 void
 draw_put_attr(unsigned r, unsigned c, uint8_t fg, uint8_t bg, unsigned n)
 {
+	++gen;
+	
 	if (r >= ws.ws_row || c >= ws.ws_col)
 		return;
 	
@@ -134,26 +193,73 @@ draw_put_attr(unsigned r, unsigned c, uint8_t fg, uint8_t bg, unsigned n)
 void
 draw_refresh(void)
 {
-	uint8_t prev_fg = 0xff, prev_bg = 0xff;
-
-	fwprintf(stdout, L"\033[H\033[0m");
+	// only cells which differ from what is already on screen are written,
+	// and the cursor is moved over those which don't.
+	csr_c = ws.ws_col;
+	cur_fg = cur_bg = 0xff;
 	
-	for (size_t i = 0; i < ws.ws_row; ++i)
+	if (CONF_SYNC_UPDATE)
+		out_str("\033[?2026h");
+	size_t head_len = out_len;
+	
+	for (unsigned i = 0; i < ws.ws_row; ++i)
 	{
-		for (size_t j = 0; j < ws.ws_col; ++j)
+		struct cell const *row = &cells[ws.ws_col * i];
+		struct cell *shown_row = &shown[ws.ws_col * i];
+		unsigned tail = blank_tail(row);
+		
+		for (unsigned j = 0; j < ws.ws_col; ++j)
 		{
-			uint8_t cur_fg = cells[ws.ws_col * i + j].fg;
-			uint8_t cur_bg = cells[ws.ws_col * i + j].bg;
+			if (!stale && cell_eq(&row[j], &shown_row[j]))
+				continue;
 			
-			if (cur_fg != prev_fg || cur_bg != prev_bg)
-				wprintf(L"\033[38;5;%um\033[48;5;%um", cur_fg, cur_bg);
+			// short runs of unchanged cells are cheaper to write again
+			// than to jump over.
+			if (csr_r == i && csr_c < j && j - csr_c <= CSR_JUMP_COST)
+			{
+				for (unsigned k = csr_c; k < j; ++k)
+					put_cell(&row[k]);
+			}
+			else if (csr_r != i || csr_c != j)
+				mv_csr(i, j);
 			
-			fputwc(cells[ws.ws_col * i + j].wch, stdout);
+			// clearing to the end of the line is only worth it for a
+			// few cells.
+			if (j >= tail && ws.ws_col - j >= CSR_JUMP_COST)
+			{
+				put_attr(row[j].fg, row[j].bg);
+				out_str("\033[K");
+				memcpy(&shown_row[j], &row[j], sizeof(struct cell) * (ws.ws_col - j));
+				break;
+			}
 			
-			prev_fg = cur_fg;
-			prev_bg = cur_bg;
+			put_cell(&row[j]);
+			shown_row[j] = row[j];
 		}
 	}
+	
+	stale = false;
+	
+	// nothing at all is written when nothing changed.
+	if (out_len == head_len)
+		out_len = 0;
+	else if (CONF_SYNC_UPDATE)
+		out_str("\033[?2026l");
+	
+	nbytes = out_len;
+	out_flush();
+}
+
+unsigned long
+draw_gen(void)
+{
+	return gen;
+}
+
+size_t
+draw_refresh_bytes(void)
+{
+	return nbytes;
 }
 
 struct win_size
@@ -171,4 +277,126 @@ sigwinch_handler(int arg)
 {
 	ioctl(0, TIOCGWINSZ, &ws);
 	cells = realloc(cells, sizeof(struct cell) * ws.ws_row * ws.ws_col);
+	shown = realloc(shown, sizeof(struct cell) * ws.ws_row * ws.ws_col);
+	stale = true;
+	++gen;
+}
+
+static bool
+cell_eq(struct cell const *a, struct cell const *b)
+{
+	return a->wch == b->wch && a->fg == b->fg && a->bg == b->bg;
+}
+
+static void
+mv_csr(unsigned r, unsigned c)
+{
+	out_str("\033[");
+	out_uint(r + 1);
+	out_str(";");
+	out_uint(c + 1);
+	out_str("H");
+	csr_r = r;
+	csr_c = c;
+}
+
+static void
+put_attr(uint8_t fg, uint8_t bg)
+{
+	if (fg == cur_fg && bg == cur_bg)
+		return;
+	
+	out_str(fg_seqs[fg]);
+	out_str(bg_seqs[bg]);
+	cur_fg = fg;
+	cur_bg = bg;
+}
+
+static void
+put_cell(struct cell const *cell)
+{
+	put_attr(cell->fg, cell->bg);
+	
+	uint8_t *dst = out_reserve(4);
+	out_len = utf8_encode_ch(dst, cell->wch) - out;
+	
+	// characters which aren't a single column wide leave the cursor
+	// somewhere other than the next cell.
+	// printable ASCII is by far the most common, and known to be narrow.
+	if ((cell->wch >= 0x20 && cell->wch < 0x7f)
+	    || wcwidth(cell->wch) == 1)
+	{
+		++csr_c;
+	}
+	else
+		csr_c = ws.ws_col;
+}
+
+static unsigned
+blank_tail(struct cell const *row)
+{
+	// finds where the run of identically colored spaces at the end of the
+	// row starts, or the end of the row if there are none.
+	unsigned c = ws.ws_col;
+	while (c > 0
+	       && row[c - 1].wch == L' '
+	       && row[c - 1].fg == row[ws.ws_col - 1].fg
+	       && row[c - 1].bg == row[ws.ws_col - 1].bg)
+	{
+		--c;
+	}
+	
+	return c;
+}
+
+static uint8_t *
+out_reserve(size_t n)
+{
+	if (out_len + n > out_cap)
+	{
+		out_cap = MAX(2 * out_cap, out_len + n);
+		out = realloc(out, out_cap);
+	}
+	
+	return out + out_len;
+}
+
+static void
+out_str(char const *str)
+{
+	size_t len = strlen(str);
+	memcpy(out_reserve(len), str, len);
+	out_len += len;
+}
+
+static void
+out_uint(unsigned n)
+{
+	char digits[16];
+	size_t ndigits = 0;
+	do
+	{
+		digits[ndigits++] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	
+	uint8_t *dst = out_reserve(ndigits);
+	for (size_t i = 0; i < ndigits; ++i)
+		dst[i] = digits[ndigits - 1 - i];
+	out_len += ndigits;
+}
+
+static void
+out_flush(void)
+{
+	size_t off = 0;
+	while (off < out_len)
+	{
+		ssize_t nw = write(STDOUT_FILENO, out + off, out_len - off);
+		if (nw < 0 && errno != EINTR)
+			break;
+		off += nw > 0 ? nw : 0;
+	}
+	
+	out_len = 0;
 }
@@ -1,14 +1,21 @@
 #include "editor.h"
 
+#include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <wchar.h>
 #include <wctype.h>
 
+#include <poll.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "buf.h"
 #include "conf.h"
@@ -23,7 +30,7 @@
 // check `sigwinch_handler()` for more information.
 #define WIN_RESIZE_SPIN 50000000
 
-extern bool flag_c;
+extern bool flag_c, flag_d;
 
 // global editor state.
 // access carefully, preferably *only* in `src/editor_bind.c`.
@@ -37,14 +44,41 @@ bool editor_ignore_sigwinch = false; // used for man reader hack.
 
 static void open_arg_files(int argc, int first_arg, char const *argv[]);
 static void sigwinch_handler(int arg);
+static void watch_buf(struct buf *b);
+static void unwatch_buf(struct buf const *b);
+static bool await_event(void);
+static bool any_jobs(void);
+static void check_watches(void);
+static bool redraw_due(struct timespec const *last);
 
 static void (*old_sigwinch_handler)(int);
+static int watch_fd;
+
+// set while changes to some files couldn't be checked yet, as their buffers
+// were still being loaded or saved.
+static bool watch_deferred = false;
+
+// state of the screen as of the last redraw, see `editor_redraw()`.
+static unsigned long drawn_gen;
+static bool drawn_mono = false, drawn_status = false;
+
+// buffer of the frame covering the whole screen as of the last redraw in mono
+// layout, which identifies the frame, as no two frames ever share a buffer.
+static struct buf const *drawn_mono_buf = NULL;
+static size_t nredrawn = 0;
 
 int
 editor_init(int argc, char const *argv[])
 {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
 	keybd_init();
 	
+	// not being able to watch files isn't fatal, they just won't be
+	// reloaded when changed by something else.
+	watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	
 	editor_frames = vec_frame_create();
 	editor_p_bufs = vec_p_buf_create();
 	editor_cur_frame = 0;
@@ -79,6 +113,18 @@ editor_init(int argc, char const *argv[])
 	editor_set_global_mode();
 	editor_arrange_frames();
 	editor_redraw();
+	
+	if (flag_d)
+	{
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+		fprintf(stderr,
+		        "editor: started with %zu frames and %zu buffers in %.3fs\n",
+		        editor_frames.size,
+		        editor_p_bufs.size,
+		        secs);
+	}
 
 	return 0;
 }
@@ -87,19 +133,42 @@ void
 editor_main_loop(void)
 {
 	editor_running = true;
+	
+	struct timespec last_redraw;
+	clock_gettime(CLOCK_MONOTONIC, &last_redraw);
 
 	while (editor_running)
 	{
-		// ensure frames sharing buffers are in a valid state.
+		// ensure frames are in a valid state after the last edits.
 		for (size_t i = 0; i < editor_frames.size; ++i)
+			frame_sync_marks(&editor_frames.data[i]);
+		
+		// background jobs wake the loop up once they finish, see
+		// `await_event()`.
+		for (size_t i = 0; i < editor_p_bufs.size; ++i)
 		{
-			struct frame *f = &editor_frames.data[i];
-			f->csr = MIN(f->csr, f->buf->size);
+			buf_reap_load(editor_p_bufs.data[i], false);
+			if (buf_reap_save(editor_p_bufs.data[i], false))
+				prompt_show(L"failed to write file!");
 		}
 		
+		if (watch_deferred)
+			check_watches();
+		
 		mode_update();
 		
-		editor_redraw();
+		// frames in between keys which are already queued up would
+		// only be overwritten straight away.
+		if (redraw_due(&last_redraw))
+		{
+			editor_redraw();
+			clock_gettime(CLOCK_MONOTONIC, &last_redraw);
+		}
+		
+		// changes to open files and finished background jobs are
+		// picked up while waiting for keys.
+		if (await_event())
+			continue;
 		
 		wint_t k = keybd_await_key();
 		if (k != KEYBD_IGNORE && (wcschr(L"\n\t", k) || iswprint(k)))
@@ -131,27 +200,48 @@ editor_quit(void)
 	vec_frame_destroy(&editor_frames);
 	vec_p_buf_destroy(&editor_p_bufs);
 	
+	// closing the descriptor removes whatever watches are left.
+	if (watch_fd != -1)
+		close(watch_fd);
+	
 	keybd_quit();
 }
 
 void
 editor_redraw(void)
 {
+	// frames which haven't changed since they were last drawn are left as
+	// they are on screen, unless anything else could have been drawn over
+	// them since.
+	// in mono layout, every frame is drawn over the same region, so only
+	// the frame which drew there last can be left as it is.
+	struct buf const *mono_buf = editor_mono ? editor_frames.data[editor_cur_frame].buf : NULL;
+	bool force = draw_gen() != drawn_gen
+	             || editor_mono != drawn_mono
+	             || mono_buf != drawn_mono_buf
+	             || drawn_status;
+	for (size_t i = 0; i < editor_frames.size; ++i)
+		force = force || frame_moved(&editor_frames.data[i]);
+	
+	nredrawn = 0;
 	if (editor_mono)
 	{
 		struct frame *f = &editor_frames.data[editor_cur_frame];
-		frame_comp_boundary(f);
-		frame_draw(f, FDF_ACTIVE | FDF_MONO);
+		nredrawn += frame_redraw(f, FDF_ACTIVE | FDF_MONO, force);
 	}
 	else
 	{
 		for (size_t i = 0; i < editor_frames.size; ++i)
 		{
-			frame_comp_boundary(&editor_frames.data[i]);
-			frame_draw(&editor_frames.data[i], FDF_ACTIVE * (i == editor_cur_frame));
+			unsigned long flags = FDF_ACTIVE * (i == editor_cur_frame);
+			nredrawn += frame_redraw(&editor_frames.data[i], flags, force);
 		}
 	}
 	
+	drawn_mono = editor_mono;
+	drawn_mono_buf = mono_buf;
+	drawn_status = false;
+	
 	// draw current bind status if necessary.
 	size_t len;
 	if (!keybd_is_exec_mac() && keybd_cur_bind(NULL)
@@ -179,11 +269,19 @@ editor_redraw(void)
 		
 		draw_put_wstr(ws.sr - 1, 0, dpy + draw_start);
 		draw_put_attr(ws.sr - 1, 0, CONF_A_GHIGH_FG, CONF_A_GHIGH_BG, draw_len);
+		drawn_status = true;
 	}
 	
+	drawn_gen = draw_gen();
 	draw_refresh();
 }
 
+size_t
+editor_frames_redrawn(void)
+{
+	return nredrawn;
+}
+
 struct buf *
 editor_add_buf(struct buf *b)
 {
@@ -206,9 +304,23 @@ editor_add_buf(struct buf *b)
 	*pb = *b;
 	vec_p_buf_add(&editor_p_bufs, &pb);
 	
+	if (pb->src_type == BST_FILE)
+		watch_buf(pb);
+	
 	return editor_p_bufs.data[editor_p_bufs.size - 1];
 }
 
+void
+editor_rm_buf(size_t ind)
+{
+	struct buf *b = editor_p_bufs.data[ind];
+	vec_p_buf_rm(&editor_p_bufs, ind);
+	
+	unwatch_buf(b);
+	buf_destroy(b);
+	free(b);
+}
+
 struct frame *
 editor_add_frame(struct frame *f)
 {
@@ -299,6 +411,7 @@ editor_reset_binds(void)
 	keybd_bind(conf_bind_kill, editor_bind_kill);
 	keybd_bind(conf_bind_paste, editor_bind_paste);
 	keybd_bind(conf_bind_undo, editor_bind_undo);
+	keybd_bind(conf_bind_redo, editor_bind_redo);
 	keybd_bind(conf_bind_copy, editor_bind_copy);
 	keybd_bind(conf_bind_ncopy, editor_bind_ncopy);
 	keybd_bind(conf_bind_find_lit, editor_bind_find_lit);
@@ -315,6 +428,11 @@ void
 editor_set_global_mode(void)
 {
 	struct frame *f = &editor_frames.data[editor_cur_frame];
+	
+	// the focused buffer is always loaded before any mode gets to look
+	// at it.
+	buf_materialize(f->buf);
+	
 	if (f->buf->src_type != BST_FILE)
 		return;
 
@@ -374,7 +492,9 @@ open_arg_files(int argc, int first_arg, char const *argv[])
 		wchar_t *wname = malloc(sizeof(wchar_t) * wname_len);
 		mbstowcs(wname, argv[i], wname_len);
 		
-		struct buf b = buf_from_file(argv[i]);
+		// files are only read once their frames are shown, so that
+		// opening many at once doesn't hold up startup.
+		struct buf b = buf_from_file_lazy(argv[i]);
 		struct frame f = frame_create(wname, editor_add_buf(&b));
 		editor_add_frame(&f);
 		
@@ -402,3 +522,182 @@ sigwinch_handler(int arg)
 	editor_arrange_frames();
 	editor_redraw();
 }
+
+static void
+watch_buf(struct buf *b)
+{
+	if (watch_fd == -1)
+		return;
+	
+	// files are usually replaced rather than rewritten in place, so the
+	// directory holding the file is watched instead of the file itself.
+	char *path = realpath(b->src, NULL);
+	if (!path)
+		return;
+	
+	*strrchr(path, '/') = 0;
+	b->watch = inotify_add_watch(watch_fd, *path ? path : "/", IN_CLOSE_WRITE | IN_MOVED_TO);
+	free(path);
+}
+
+static void
+unwatch_buf(struct buf const *b)
+{
+	// buffers of files in the same directory share its watch, which is
+	// only removed along with the last of them.
+	if (b->watch == -1)
+		return;
+	
+	for (size_t i = 0; i < editor_p_bufs.size; ++i)
+	{
+		if (editor_p_bufs.data[i]->watch == b->watch)
+			return;
+	}
+	
+	inotify_rm_watch(watch_fd, b->watch);
+}
+
+static bool
+await_event(void)
+{
+	if (keybd_is_exec_mac())
+		return false;
+	
+	// descriptors which couldn't be opened are -1, and ignored by `poll()`.
+	struct pollfd fds[] =
+	{
+		{
+			.fd = STDIN_FILENO,
+			.events = POLLIN,
+		},
+		{
+			.fd = watch_fd,
+			.events = POLLIN,
+		},
+		{
+			.fd = buf_wake_fd(),
+			.events = POLLIN,
+		},
+	};
+	
+	// while any job is running, the loop comes back around regularly, so
+	// that loading progress gets redrawn.
+	// this also catches jobs which woke the editor just before their
+	// thread was done, and so couldn't be reaped yet.
+	int timeout = any_jobs() ? CONF_LOAD_PROGRESS_INTERVAL : -1;
+	while (poll(fds, ARRAY_SIZE(fds), timeout) == -1)
+	{
+		if (errno != EINTR)
+			return false;
+	}
+	
+	// keys take priority, other events will still be there afterwards.
+	if (fds[0].revents & POLLIN)
+		return false;
+	
+	// the jobs themselves are reaped at the top of the main loop.
+	if (fds[2].revents & POLLIN)
+	{
+		uint8_t bytes[64];
+		while (read(fds[2].fd, bytes, sizeof(bytes)) > 0)
+			;
+	}
+	
+	if (fds[1].revents & POLLIN)
+		check_watches();
+	
+	return true;
+}
+
+static bool
+any_jobs(void)
+{
+	for (size_t i = 0; i < editor_p_bufs.size; ++i)
+	{
+		struct buf const *b = editor_p_bufs.data[i];
+		if (b->load_job || b->save_job)
+			return true;
+	}
+	
+	return false;
+}
+
+static void
+check_watches(void)
+{
+	// events only tell that something in a watched directory changed, the
+	// buffers themselves know whether their files did.
+	union
+	{
+		struct inotify_event ev;
+		char bytes[sizeof(struct inotify_event) + NAME_MAX + 1];
+	} evbuf;
+	while (read(watch_fd, &evbuf, sizeof(evbuf)) > 0)
+		;
+	
+	watch_deferred = false;
+	for (size_t i = 0; i < editor_p_bufs.size; ++i)
+	{
+		struct buf *b = editor_p_bufs.data[i];
+		if (b->watch == -1)
+			continue;
+		
+		// buffers which haven't been read yet will be read as the file
+		// is then, so only what is known about it needs updating.
+		if (b->flags & BF_LAZY)
+		{
+			if (buf_src_changed(b))
+				buf_note_src(b);
+			continue;
+		}
+		
+		// saves of the buffer itself replace the file too, and are
+		// recognized once they have been reaped.
+		// events come in for the editor's own temporary files as well,
+		// so waiting on a job here would hold up the editor for nothing;
+		// the buffer is checked again once the job is done instead.
+		buf_reap_load(b, false);
+		if (buf_reap_save(b, false))
+			prompt_show(L"failed to write file!");
+		
+		if (b->load_job || b->save_job)
+		{
+			watch_deferred = true;
+			continue;
+		}
+		
+		if (!buf_src_changed(b))
+			continue;
+		
+		// changes to the file are merged into unsaved edits, and only
+		// those lines which were changed on both sides need asking about.
+		// declining keeps the buffer's version of them, but still brings
+		// in everything else.
+		enum buf_merge_status ms = buf_merge(b, BMM_NONE);
+		if (ms == BMS_CONFLICT)
+		{
+			size_t msg_len = strlen(b->src) + 80;
+			wchar_t *msg = malloc(sizeof(wchar_t) * msg_len);
+			swprintf(msg, msg_len, L"file changed on disk: %s! discard conflicting changes and take the file's?", (char *)b->src);
+			int confirm = prompt_yes_no(msg, false);
+			free(msg);
+			
+			ms = buf_merge(b, confirm == 1 ? BMM_TAKE_FILE : BMM_KEEP_BUF);
+		}
+		
+		if (ms == BMS_FAIL)
+			prompt_show(L"failed to reload file!");
+	}
+}
+
+static bool
+redraw_due(struct timespec const *last)
+{
+	if (!keybd_key_pending())
+		return true;
+	
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long ms = (now.tv_sec - last->tv_sec) * 1000 + (now.tv_nsec - last->tv_nsec) / 1000000;
+	return ms >= CONF_REDRAW_MAX_DELAY;
+}
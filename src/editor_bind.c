@@ -29,6 +29,14 @@ extern bool editor_ignore_sigwinch;
 void
 editor_bind_quit(void)
 {
+	// saves still in flight are finished first, so that failed ones
+	// count as unsaved.
+	for (size_t i = 0; i < editor_p_bufs.size; ++i)
+	{
+		if (buf_reap_save(editor_p_bufs.data[i], true))
+			prompt_show(L"failed to write file!");
+	}
+	
 	bool mod_exists = false;
 	for (size_t i = 0; i < editor_p_bufs.size; ++i)
 	{
@@ -116,11 +124,7 @@ editor_bind_kill_frame(void)
 		}
 
 		if (orphan)
-		{
-			buf_destroy(editor_p_bufs.data[i]);
-			free(editor_p_bufs.data[i]);
-			vec_p_buf_rm(&editor_p_bufs, i--);
-		}
+			editor_rm_buf(i--);
 	}
 
 	if (editor_frames.size == 0)
@@ -494,15 +498,9 @@ editor_bind_focus(void)
 	unsigned csrr, csrc;
 	buf_pos(f->buf, f->csr, &csrr, &csrc);
 
-	f->buf_start = 0;
-	unsigned bsr = 0;
 	long dst_bsr = (long)csrr - (f->sr - 1) / 2;
 	dst_bsr = MAX(dst_bsr, 0);
-	while (f->buf_start < f->buf->size && bsr < dst_bsr)
-	{
-		if (buf_get_wch(f->buf, f->buf_start++) == L'\n')
-			++bsr;
-	}
+	f->buf_start = buf_line_start(f->buf, dst_bsr);
 
 	frame_comp_boundary(f);
 }
@@ -552,16 +550,13 @@ editor_bind_undo(void)
 {
 	struct frame *f = &editor_frames.data[editor_cur_frame];
 
-	if (f->buf->hist.size == 0)
+	struct buf_op const *bo = buf_peek_undo(f->buf);
+	if (!bo)
 	{
 		prompt_show(L"no further undo information!");
 		editor_redraw();
 		return;
 	}
-
-	struct buf_op const *bo = &f->buf->hist.data[f->buf->hist.size - 1];
-	while (bo > f->buf->hist.data && bo->type == BOT_BRK)
-		--bo;
 	
 	size_t csr_dst;
 	switch (bo->type)
@@ -587,6 +582,35 @@ editor_bind_undo(void)
 	f->csr_want_col = csrc;
 }
 
+void
+editor_bind_redo(void)
+{
+	struct frame *f = &editor_frames.data[editor_cur_frame];
+	
+	struct buf_op const *bo = buf_peek_redo(f->buf);
+	if (!bo)
+	{
+		prompt_show(L"no further redo information!");
+		editor_redraw();
+		return;
+	}
+	
+	// breaks are never redone, so anything else is an erase.
+	size_t csr_dst = bo->type == BOT_WRITE ? bo->ub : bo->lb;
+	
+	if (buf_redo(f->buf))
+	{
+		prompt_show(L"failed to redo last operation!");
+		editor_redraw();
+		return;
+	}
+	
+	unsigned csrr, csrc;
+	buf_pos(f->buf, csr_dst, &csrr, &csrc);
+	frame_mv_csr(f, csrr, csrc);
+	f->csr_want_col = csrc;
+}
+
 void
 editor_bind_copy(void)
 {
@@ -689,15 +713,13 @@ ask_again:;
 	}
 	
 	size_t search_pos, needle_len = wcslen(needle);
-	wchar_t *cmp_buf = malloc(sizeof(wchar_t) * (needle_len + 1));
 	struct frame *f = &editor_frames.data[editor_cur_frame];
 	for (search_pos = f->csr + 1; search_pos + needle_len <= f->buf->size; ++search_pos)
 	{
-		if (!wcscmp(buf_get_wstr(f->buf, cmp_buf, search_pos, needle_len + 1), needle))
+		if (buf_match_at(f->buf, search_pos, needle))
 			break;
 	}
 	
-	free(cmp_buf);
 	free(needle);
 	
 	if (search_pos + needle_len > f->buf->size)
@@ -11,7 +11,35 @@
 // padding size around line numbers.
 #define GUTTER (CONF_GUTTER_LEFT + CONF_GUTTER_RIGHT)
 
-static void draw_line(struct frame const *f, unsigned *line, size_t *draw_csr);
+// position of a character relative to the text area of a frame.
+struct frame_cell
+{
+	unsigned r, c;
+	
+	// number of columns drawn, which is only ever more than one for tabs
+	// and is zero for newlines.
+	unsigned w;
+};
+
+struct frame_layout
+{
+	// what the layout was worked out from.
+	struct buf const *buf;
+	uint64_t buf_ver;
+	size_t buf_start;
+	unsigned sr, right_edge;
+	
+	// one cell for each character from `buf_start` on, up to and including
+	// either the first one past the bottom of the frame or the end of the
+	// buffer.
+	struct frame_cell *cells;
+	size_t ncells, cap;
+};
+
+static struct frame_layout const *get_layout(struct frame const *f);
+static struct frame_cell const *layout_cell(struct frame const *f, size_t pos);
+static void advance(struct buf const *b, size_t pos, unsigned *r, unsigned *c);
+static void draw_cell(struct frame const *f, size_t pos, struct frame_cell const *fc);
 static void exec_highlight(struct frame const *f, struct highlight const *hl);
 
 VEC_DEF_IMPL(struct frame, frame)
@@ -48,6 +76,15 @@ frame_create(wchar_t const *name, struct buf *buf)
 	else
 		local_mode = strdup("\0");
 	
+	struct frame_layout *layout = malloc(sizeof(struct frame_layout));
+	*layout = (struct frame_layout)
+	{
+		.buf = NULL,
+		.cells = NULL,
+		.ncells = 0,
+		.cap = 0,
+	};
+	
 	return (struct frame)
 	{
 		.name = wcsdup(name),
@@ -58,9 +95,18 @@ frame_create(wchar_t const *name, struct buf *buf)
 		.buf = buf,
 		.csr = 0,
 		.buf_start = 0,
+		.start_mark = buf_mark_add(buf, 0),
+		.csr_mark = buf_mark_add(buf, 0),
+		.start_synced = 0,
+		.csr_synced = 0,
 		.csr_want_col = 0,
 		.linum_width = linum_width,
 		.local_mode = local_mode,
+		.layout = layout,
+		.drawn =
+		{
+			.valid = false,
+		},
 	};
 }
 
@@ -69,14 +115,17 @@ frame_destroy(struct frame *f)
 {
 	free(f->name);
 	free(f->local_mode);
+	free(f->layout->cells);
+	free(f->layout);
+	buf_mark_rm(f->buf, f->start_mark);
+	buf_mark_rm(f->buf, f->csr_mark);
 }
 
 void
 frame_draw(struct frame const *f, unsigned long flags)
 {
-	unsigned bsr, bsc, ber, bec;
+	unsigned bsr, bsc;
 	buf_pos(f->buf, f->buf_start, &bsr, &bsc);
-	buf_pos(f->buf, f->buf->size, &ber, &bec);
 
 	unsigned left_edge = GUTTER + f->linum_width;
 
@@ -89,6 +138,13 @@ frame_draw(struct frame const *f, unsigned long flags)
 	
 	if (f->buf->flags & BF_MODIFIED)
 		wcscat(draw_marks, CONF_MARK_MOD);
+	if (f->buf->flags & BF_SAVING)
+		wcscat(draw_marks, CONF_MARK_SAVING);
+	if (f->buf->flags & BF_LOADING)
+	{
+		size_t len = wcslen(draw_marks);
+		swprintf(draw_marks + len, ARRAY_SIZE(draw_marks) - len, CONF_MARK_LOADING, buf_load_pct(f->buf));
+	}
 	if (flags & FDF_MONO)
 		wcscat(draw_marks, CONF_MARK_MONO);
 	
@@ -114,8 +170,8 @@ frame_draw(struct frame const *f, unsigned long flags)
 	          CONF_A_NORM_BG);
 
 	// write margins.
-	unsigned befr, befc;
-	frame_pos(f, f->buf->size, &befr, &befc);
+	struct frame_cell const *end_cell = layout_cell(f, f->buf->size);
+	unsigned befr = end_cell ? end_cell->r : f->sr;
 	for (size_t i = 0; i < conf_mtab_size; ++i)
 	{
 		unsigned draw_col = left_edge + conf_mtab[i].col;
@@ -135,20 +191,26 @@ frame_draw(struct frame const *f, unsigned long flags)
 	}
 
 	// write lines and linums.
-	size_t draw_csr = f->buf_start;
-	unsigned linum_ind = 0;
-	for (unsigned i = 1; i < f->sr; ++i)
+	struct frame_layout const *layout = get_layout(f);
+	unsigned linum = bsr;
+	for (size_t i = 0; i < layout->ncells; ++i)
 	{
-		if (linum_ind++ <= ber - bsr)
+		struct frame_cell const *fc = &layout->cells[i];
+		if (fc->r >= f->sr)
+			break;
+		
+		size_t pos = f->buf_start + i;
+		if (i == 0 || buf_get_wch(f->buf, pos - 1) == L'\n')
 		{
 			wchar_t draw_text[16];
-			swprintf(draw_text, 16, L"%u", bsr + linum_ind);
-			draw_put_wstr(f->pr + i,
+			swprintf(draw_text, 16, L"%u", ++linum);
+			draw_put_wstr(f->pr + fc->r,
 			              f->pc + CONF_GUTTER_LEFT + f->linum_width - wcslen(draw_text),
 			              draw_text);
 		}
-
-		draw_line(f, &i, &draw_csr);
+		
+		if (pos < f->buf->size)
+			draw_cell(f, pos, fc);
 	}
 	
 	// draw gutter.
@@ -183,51 +245,105 @@ done_highlight:;
 	              1);
 }
 
+bool
+frame_redraw(struct frame *f, unsigned long flags, bool force)
+{
+	struct frame_drawn const *d = &f->drawn;
+	unsigned load_pct = buf_load_pct(f->buf);
+	if (!force
+	    && d->valid
+	    && d->buf == f->buf
+	    && d->buf_ver == f->buf->ver
+	    && d->buf_flags == f->buf->flags
+	    && d->load_pct == load_pct
+	    && d->name == f->name
+	    && d->local_mode == f->local_mode
+	    && d->buf_start == f->buf_start
+	    && d->csr == f->csr
+	    && d->flags == flags
+	    && !frame_moved(f))
+	{
+		return false;
+	}
+	
+	// buffers are only read once some of their text is about to be shown,
+	// which frames squeezed down to their title never do.
+	if (f->sr > 1)
+		buf_materialize(f->buf);
+	
+	frame_comp_boundary(f);
+	frame_draw(f, flags);
+	
+	f->drawn = (struct frame_drawn)
+	{
+		.valid = true,
+		.buf = f->buf,
+		.buf_ver = f->buf->ver,
+		.buf_flags = f->buf->flags,
+		.load_pct = load_pct,
+		.name = f->name,
+		.local_mode = f->local_mode,
+		.buf_start = f->buf_start,
+		.csr = f->csr,
+		.pr = f->pr,
+		.pc = f->pc,
+		.sr = f->sr,
+		.sc = f->sc,
+		.flags = flags,
+	};
+	
+	return true;
+}
+
+bool
+frame_moved(struct frame const *f)
+{
+	struct frame_drawn const *d = &f->drawn;
+	return d->pr != f->pr || d->pc != f->pc || d->sr != f->sr || d->sc != f->sc;
+}
+
 void
 frame_pos(struct frame const *f, size_t pos, unsigned *out_r, unsigned *out_c)
 {
-	unsigned right_edge = f->sc - GUTTER - f->linum_width;
 	pos = MIN(pos, f->buf->size);
 	
 	*out_r = 1;
 	*out_c = 0;
-
-	for (size_t i = f->buf_start; i < pos; ++i)
+	
+	if (pos >= f->buf_start)
 	{
-		wchar_t wch = buf_get_wch(f->buf, i);
+		// positions below the frame are found by carrying on from the last
+		// character that was laid out.
+		struct frame_layout const *l = get_layout(f);
+		size_t last = f->buf_start + l->ncells - 1;
+		struct frame_cell const *fc = &l->cells[MIN(pos, last) - f->buf_start];
+		*out_r = fc->r;
+		*out_c = fc->c;
 		
-		if (wch == L'\t')
-			*out_c += CONF_TAB_SIZE - *out_c % CONF_TAB_SIZE - 1;
-		else if (wch == L'\n' || *out_c >= right_edge - 1)
+		for (size_t i = last; i < pos; ++i)
 		{
-			*out_c = 0;
-			++*out_r;
-			continue;
+			advance(f->buf, i, out_r, out_c);
+			if (*out_c >= l->right_edge)
+			{
+				*out_c = 0;
+				++*out_r;
+			}
 		}
-
-		++*out_c;
 	}
-
+	
 	*out_c += GUTTER + f->linum_width;
 }
 
 void
 frame_mv_csr(struct frame *f, unsigned r, unsigned c)
 {
-	f->csr = 0;
-	
-	while (f->csr < f->buf->size && r > 0)
-	{
-		if (buf_get_wch(f->buf, f->csr++) == L'\n')
-			--r;
-	}
-	
-	while (f->csr < f->buf->size
-	       && buf_get_wch(f->buf, f->csr) != L'\n'
-	       && c > 0)
+	if (r >= buf_line_cnt(f->buf))
+		f->csr = f->buf->size;
+	else
 	{
-		++f->csr;
-		--c;
+		size_t lb = buf_line_start(f->buf, r);
+		size_t ub = buf_line_end(f->buf, r);
+		f->csr = lb + MIN(c, ub - lb);
 	}
 	
 	frame_comp_boundary(f);
@@ -293,16 +409,8 @@ frame_comp_boundary(struct frame *f)
 	buf_pos(f->buf, f->buf_start, &bsr, &bsc);
 	buf_pos(f->buf, f->csr, &csrr, &csrc);
 	
-	while (csrr < bsr)
-	{
-		--f->buf_start;
-		while (f->buf_start > 0
-		       && buf_get_wch(f->buf, f->buf_start - 1) != L'\n')
-		{
-			--f->buf_start;
-		}
-		++csrr;
-	}
+	if (csrr < bsr)
+		f->buf_start = buf_line_start(f->buf, csrr);
 	
 	// fix linum width.
 	unsigned ber, bec;
@@ -312,69 +420,131 @@ frame_comp_boundary(struct frame *f)
 		++f->linum_width;
 }
 
-static void
-draw_line(struct frame const *f, unsigned *line, size_t *draw_csr)
+static struct frame_layout const *
+get_layout(struct frame const *f)
 {
-	unsigned left_edge = GUTTER + f->linum_width;
-	unsigned right_edge = f->sc - left_edge;
-	unsigned c = 0;
-
-	while (*draw_csr < f->buf->size
-	       && buf_get_wch(f->buf, *draw_csr) != L'\n')
+	struct frame_layout *l = f->layout;
+	unsigned right_edge = f->sc - GUTTER - f->linum_width;
+	
+	// edits always change the buffer version, so a layout for the same
+	// version of the buffer seen from the same place is still correct.
+	if (l->buf == f->buf
+	    && l->buf_ver == f->buf->ver
+	    && l->buf_start == f->buf_start
+	    && l->sr == f->sr
+	    && l->right_edge == right_edge)
+	{
+		return l;
+	}
+	
+	l->buf = f->buf;
+	l->buf_ver = f->buf->ver;
+	l->buf_start = f->buf_start;
+	l->sr = f->sr;
+	l->right_edge = right_edge;
+	l->ncells = 0;
+	
+	unsigned r = 1, c = 0;
+	for (size_t i = f->buf_start; i <= f->buf->size; ++i)
 	{
 		if (c >= right_edge)
 		{
 			c = 0;
-			++*line;
+			++r;
 		}
-
-		if (*line >= f->sr)
-			break;
 		
-		// 0xfffd used as replacement for non-printing chars.
-		wchar_t wch = buf_get_wch(f->buf, *draw_csr);
-		wch = wch == L'\t' || iswprint(wch) ? wch : 0xfffd;
-		
-		switch (wch)
+		unsigned w;
+		switch (i < f->buf->size ? buf_get_wch(f->buf, i) : L'\n')
 		{
+		case L'\n':
+			w = 0;
+			break;
 		case L'\t':
-		{
-			unsigned nch = CONF_TAB_SIZE - c % CONF_TAB_SIZE;
-			nch = MIN(nch, right_edge - c);
-			
-			for (unsigned i = 0; i < nch && c + i < right_edge; ++i)
-				draw_put_wch(f->pr + *line, f->pc + left_edge + c + i, L' ');
-			
-			draw_put_attr(f->pr + *line,
-			              f->pc + left_edge + c,
-			              CONF_A_NORM_FG,
-			              CONF_A_NORM_BG,
-			              nch);
-			
-			c += CONF_TAB_SIZE - c % CONF_TAB_SIZE;
-			
+			w = CONF_TAB_SIZE - c % CONF_TAB_SIZE;
+			w = MIN(w, right_edge - c);
 			break;
-		}
 		default:
-			draw_put_wch(f->pr + *line, f->pc + left_edge + c, wch);
-			
-			draw_put_attr(f->pr + *line,
-			              f->pc + left_edge + c,
-			              CONF_A_NORM_FG,
-			              CONF_A_NORM_BG,
-			              1);
-			
-			++c;
+			w = 1;
 			break;
 		}
 		
-		++*draw_csr;
+		if (l->ncells >= l->cap)
+		{
+			l->cap = l->cap ? 2 * l->cap : 256;
+			l->cells = realloc(l->cells, sizeof(struct frame_cell) * l->cap);
+		}
+		
+		l->cells[l->ncells++] = (struct frame_cell)
+		{
+			.r = r,
+			.c = c,
+			.w = w,
+		};
+		
+		if (r >= f->sr || i == f->buf->size)
+			break;
+		
+		advance(f->buf, i, &r, &c);
 	}
+	
+	return l;
+}
 
-	if (c >= right_edge)
-		++*line;
+static struct frame_cell const *
+layout_cell(struct frame const *f, size_t pos)
+{
+	struct frame_layout const *l = get_layout(f);
+	if (pos < f->buf_start || pos - f->buf_start >= l->ncells)
+		return NULL;
+	
+	return &l->cells[pos - f->buf_start];
+}
 
-	++*draw_csr;
+static void
+advance(struct buf const *b, size_t pos, unsigned *r, unsigned *c)
+{
+	switch (buf_get_wch(b, pos))
+	{
+	case L'\n':
+		*c = 0;
+		++*r;
+		break;
+	case L'\t':
+		*c += CONF_TAB_SIZE - *c % CONF_TAB_SIZE;
+		break;
+	default:
+		++*c;
+		break;
+	}
+}
+
+static void
+draw_cell(struct frame const *f, size_t pos, struct frame_cell const *fc)
+{
+	unsigned left_edge = GUTTER + f->linum_width;
+	
+	// 0xfffd used as replacement for non-printing chars.
+	wchar_t wch = buf_get_wch(f->buf, pos);
+	wch = wch == L'\t' || wch == L'\n' || iswprint(wch) ? wch : 0xfffd;
+	
+	switch (wch)
+	{
+	case L'\n':
+		return;
+	case L'\t':
+		for (unsigned i = 0; i < fc->w; ++i)
+			draw_put_wch(f->pr + fc->r, f->pc + left_edge + fc->c + i, L' ');
+		break;
+	default:
+		draw_put_wch(f->pr + fc->r, f->pc + left_edge + fc->c, wch);
+		break;
+	}
+	
+	draw_put_attr(f->pr + fc->r,
+	              f->pc + left_edge + fc->c,
+	              CONF_A_NORM_FG,
+	              CONF_A_NORM_BG,
+	              fc->w);
 }
 
 static void
@@ -387,43 +557,32 @@ exec_highlight(struct frame const *f, struct highlight const *hl)
 	uint8_t fg, bg;
 	while (!hl->find(f->buf, off, &lb, &ub, &fg, &bg))
 	{
-		unsigned hlr, hlc;
-		frame_pos(f, lb, &hlr, &hlc);
-		if (hlr >= f->sr)
+		struct frame_cell const *fc = layout_cell(f, MAX(lb, f->buf_start));
+		if (!fc || fc->r >= f->sr)
 			break;
 		
-		unsigned c = hlc - left_edge, r = hlr;
-		for (size_t i = lb; i < ub; ++i)
+		for (size_t i = MAX(lb, f->buf_start); i < ub; ++i, ++fc)
 		{
-			if (c >= f->sc - left_edge)
-			{
-				c = 0;
-				++r;
-			}
-
-			if (r >= f->sr)
-				break;
-
-			unsigned w;
-			switch (buf_get_wch(f->buf, i))
-			{
-			case L'\n':
-				c = 0;
-				++r;
-				continue;
-			case L'\t':
-				w = CONF_TAB_SIZE - c % CONF_TAB_SIZE;
-				break;
-			default:
-				w = 1;
+			if (i >= f->buf->size || fc->r >= f->sr)
 				break;
-			}
-
-			draw_put_attr(f->pr + r, f->pc + left_edge + c, fg, bg, w);
 			
-			c += w;
+			draw_put_attr(f->pr + fc->r, f->pc + left_edge + fc->c, fg, bg, fc->w);
 		}
 
 		off = ub;
 	}
 }
+
+void
+frame_sync_marks(struct frame *f)
+{
+	// positions the frame moved itself are pushed to its marks, while
+	// untouched ones pick up any shifts caused by edits.
+	if (f->buf_start != f->start_synced)
+		buf_mark_put(f->buf, f->start_mark, f->buf_start);
+	if (f->csr != f->csr_synced)
+		buf_mark_put(f->buf, f->csr_mark, f->csr);
+	
+	f->buf_start = f->start_synced = buf_mark_get(f->buf, f->start_mark);
+	f->csr = f->csr_synced = buf_mark_get(f->buf, f->csr_mark);
+}
@@ -0,0 +1,291 @@
+#include "hist_file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "conf.h"
+#include "utf8.h"
+#include "util.h"
+
+#define HIST_FILE_MAGIC "MDU1"
+#define HIST_FILE_HDR_LEN 4
+
+static char *hist_path(char const *src);
+static uint8_t *reserve(struct hist_file_enc *enc, size_t n);
+
+int
+hist_file_open(char const *src, struct hist_file *out)
+{
+	*out = (struct hist_file)
+	{
+		.map = NULL,
+		.len = 0,
+		.end = 0,
+	};
+	
+	char *path = hist_path(src);
+	int fd = open(path, O_RDONLY);
+	free(path);
+	if (fd == -1)
+		return 1;
+	
+	struct stat s;
+	if (fstat(fd, &s) || s.st_size <= HIST_FILE_HDR_LEN)
+	{
+		close(fd);
+		return 1;
+	}
+	
+	// the mapping stays valid even once the file is replaced by a later
+	// save.
+	void *map = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 1;
+	
+	if (memcmp(map, HIST_FILE_MAGIC, HIST_FILE_HDR_LEN))
+	{
+		munmap(map, s.st_size);
+		return 1;
+	}
+	
+	out->map = map;
+	out->len = s.st_size;
+	out->end = s.st_size;
+	
+	return 0;
+}
+
+void
+hist_file_close(struct hist_file *hf)
+{
+	if (hf->map)
+		munmap((void *)hf->map, hf->len);
+	
+	hf->map = NULL;
+	hf->len = hf->end = 0;
+}
+
+int
+hist_file_peek(struct hist_file const *hf, struct hist_rec *out)
+{
+	// every record ends in its own length, so that the file can be read
+	// from the back.
+	if (!hf->map || hf->end < HIST_FILE_HDR_LEN + 5)
+		return 1;
+	
+	uint8_t const *foot = hf->map + hf->end - 4;
+	size_t rec_len = (size_t)foot[0]
+	                 | (size_t)foot[1] << 8
+	                 | (size_t)foot[2] << 16
+	                 | (size_t)foot[3] << 24;
+	if (rec_len == 0 || rec_len > hf->end - 4 - HIST_FILE_HDR_LEN)
+		return 1;
+	
+	uint8_t const *p = foot - rec_len;
+	*out = (struct hist_rec)
+	{
+		.type = *p++,
+		.lb = 0,
+		.ub = 0,
+		.key = 0,
+		.bytes = NULL,
+		.nbytes = 0,
+	};
+	
+	uint64_t lb, ub;
+	switch (out->type)
+	{
+	case HRT_WRITE:
+	case HRT_ERASE:
+		if (get_varint(&p, foot, &lb) || get_varint(&p, foot, &ub) || lb > ub)
+			return 1;
+		out->lb = lb;
+		out->ub = ub;
+		out->bytes = p;
+		out->nbytes = foot - p;
+		return 0;
+	case HRT_BRK:
+		return 0;
+	case HRT_KEY:
+		if (foot - p != 8)
+			return 1;
+		for (int i = 0; i < 8; ++i)
+			out->key |= (uint64_t)p[i] << 8 * i;
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+void
+hist_file_pop(struct hist_file *hf)
+{
+	uint8_t const *foot = hf->map + hf->end - 4;
+	size_t rec_len = (size_t)foot[0]
+	                 | (size_t)foot[1] << 8
+	                 | (size_t)foot[2] << 16
+	                 | (size_t)foot[3] << 24;
+	hf->end -= rec_len + 4;
+}
+
+size_t
+hist_file_decode(struct hist_rec const *rec, wchar_t *out)
+{
+	// erased text is stored front to back, unlike in memory.
+	uint8_t const *p = rec->bytes, *end = rec->bytes + rec->nbytes;
+	size_t n = 0;
+	while (n < rec->ub - rec->lb && p < end)
+	{
+		int len = utf8_seq_len(*p);
+		if (!len || len > end - p)
+			break;
+		
+		uchar32 ch = utf8_decode_ch(p);
+		out[n++] = ch == UTF8_BAD_CH ? 0xfffd : ch;
+		p += len;
+	}
+	
+	return n;
+}
+
+void
+hist_file_put(struct hist_file_enc *enc,
+              struct hist_rec const *rec,
+              wchar_t const *rev_data)
+{
+	size_t n = rec->type == HRT_ERASE ? rec->ub - rec->lb : 0;
+	uint8_t *start = reserve(enc, 1 + 2 * VARINT_MAX + 4 * n + 8 + 4);
+	uint8_t *bytes = start;
+	
+	*bytes++ = rec->type;
+	switch (rec->type)
+	{
+	case HRT_WRITE:
+	case HRT_ERASE:
+		bytes = put_varint(bytes, rec->lb);
+		bytes = put_varint(bytes, rec->ub);
+		
+		// characters without a valid encoding are replaced rather than
+		// skipped, so that the text keeps its length.
+		for (size_t i = 0; i < n; ++i)
+		{
+			uint8_t *next = utf8_encode_ch(bytes, rev_data[n - 1 - i]);
+			bytes = next != bytes ? next : utf8_encode_ch(bytes, 0xfffd);
+		}
+		break;
+	case HRT_KEY:
+		for (int i = 0; i < 8; ++i)
+			*bytes++ = rec->key >> 8 * i;
+		break;
+	}
+	
+	size_t rec_len = bytes - start;
+	for (int i = 0; i < 4; ++i)
+		*bytes++ = rec_len >> 8 * i;
+	
+	enc->n += bytes - start;
+}
+
+void
+hist_file_put_raw(struct hist_file_enc *enc, struct hist_file const *hf)
+{
+	// records which were never read back are copied over as they are.
+	if (!hf->map || hf->end <= HIST_FILE_HDR_LEN)
+		return;
+	
+	size_t n = hf->end - HIST_FILE_HDR_LEN;
+	memcpy(reserve(enc, n), hf->map + HIST_FILE_HDR_LEN, n);
+	enc->n += n;
+}
+
+int
+hist_file_write(char const *src, struct hist_file_enc const *enc)
+{
+	char *path = hist_path(src);
+	
+	if (CONF_UNDO_DIR)
+	{
+		char *dir = strdup(path);
+		*(strrchr(dir, '/') + 1) = 0;
+		mk_dir_rec(dir);
+		free(dir);
+	}
+	
+	// the file is replaced all at once, so that a crash never leaves a
+	// partial history behind.
+	size_t tmp_len = strlen(path) + 8;
+	char *tmp = malloc(tmp_len);
+	snprintf(tmp, tmp_len, "%s.XXXXXX", path);
+	
+	int fd = mkstemp(tmp);
+	if (fd == -1)
+	{
+		free(tmp);
+		free(path);
+		return 1;
+	}
+	
+	if (write_all(fd, (uint8_t const *)HIST_FILE_MAGIC, HIST_FILE_HDR_LEN)
+	    || write_all(fd, enc->bytes, enc->n)
+	    || close(fd)
+	    || rename(tmp, path))
+	{
+		unlink(tmp);
+		free(tmp);
+		free(path);
+		return 1;
+	}
+	
+	free(tmp);
+	free(path);
+	
+	return 0;
+}
+
+static char *
+hist_path(char const *src)
+{
+	char const *dir = CONF_UNDO_DIR;
+	if (!dir)
+		return side_path(src, CONF_UNDO_SUFFIX);
+	
+	// histories kept together in one directory are named after the full
+	// path of their file, with slashes swapped out.
+	char *real = realpath(src, NULL);
+	char const *full = real ? real : src;
+	
+	char const *home = getenv("HOME");
+	bool tilde = dir[0] == '~' && home;
+	
+	size_t path_len = strlen(dir) + strlen(full) + strlen(CONF_UNDO_SUFFIX) + (tilde ? strlen(home) : 0) + 2;
+	char *path = malloc(path_len);
+	snprintf(path, path_len, "%s%s/", tilde ? home : "", tilde ? dir + 1 : dir);
+	
+	size_t off = strlen(path);
+	for (size_t i = 0; full[i]; ++i)
+		path[off++] = full[i] == '/' ? '%' : full[i];
+	strcpy(path + off, CONF_UNDO_SUFFIX);
+	
+	free(real);
+	
+	return path;
+}
+
+static uint8_t *
+reserve(struct hist_file_enc *enc, size_t n)
+{
+	if (enc->n + n > enc->cap)
+	{
+		enc->cap = 2 * (enc->n + n);
+		enc->bytes = realloc(enc->bytes, enc->cap);
+	}
+	
+	return enc->bytes + enc->n;
+}
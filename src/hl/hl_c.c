@@ -256,12 +256,8 @@ hl_comment(struct buf const *buf,
 	}
 	else
 	{
-		wchar_t cmp[3];
-		while (j + 1 < buf->size
-		       && wcscmp(buf_get_wstr(buf, cmp, j, 3), L"*/"))
-		{
+		while (j + 1 < buf->size && !buf_match_at(buf, j, L"*/"))
 			++j;
-		}
 	}
 	
 	*out_lb = *i;
@@ -327,16 +323,11 @@ hl_word(struct buf const *buf,
 			wt = WT_FUNC;
 	}
 	
+	size_t len = j - *i;
 	for (size_t kw = 0; kw < ARRAY_SIZE(keywords); ++kw)
 	{
-		size_t len = j - *i + 1;
-		if (len > 64)
-			break;
-		
-		wchar_t cmp[64];
-		buf_get_wstr(buf, cmp, *i, len);
-		
-		if (!wcscmp(keywords[kw], cmp))
+		if (wcslen(keywords[kw]) == len
+		    && buf_match_at(buf, *i, keywords[kw]))
 		{
 			wt = WT_KEYWORD;
 			break;
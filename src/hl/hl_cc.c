@@ -150,8 +150,6 @@ hl_cc_find(struct buf const *buf,
            uint8_t *out_fg,
            uint8_t *out_bg)
 {
-	wchar_t cmp_buf[20]; // max rstr compare length (19) plus 1.
-	
 	for (size_t i = off; i < buf->size; ++i)
 	{
 		if (buf_get_wch(buf, i) == L'#')
@@ -159,11 +157,11 @@ hl_cc_find(struct buf const *buf,
 			if (!hl_preproc(buf, &i, out_lb, out_ub, out_fg, out_bg))
 				return 0;
 		}
-		else if (i + 2 < buf->size && !wcscmp(buf_get_wstr(buf, cmp_buf, i, 3), L"R\"")
-		         || i + 3 < buf->size && !wcscmp(buf_get_wstr(buf, cmp_buf, i, 4), L"LR\"")
-		         || i + 4 < buf->size && !wcscmp(buf_get_wstr(buf, cmp_buf, i, 5), L"u8R\"")
-		         || i + 3 < buf->size && !wcscmp(buf_get_wstr(buf, cmp_buf, i, 4), L"uR\"")
-		         || i + 3 < buf->size && !wcscmp(buf_get_wstr(buf, cmp_buf, i, 4), L"UR\""))
+		else if (i + 2 < buf->size && buf_match_at(buf, i, L"R\"")
+		         || i + 3 < buf->size && buf_match_at(buf, i, L"LR\"")
+		         || i + 4 < buf->size && buf_match_at(buf, i, L"u8R\"")
+		         || i + 3 < buf->size && buf_match_at(buf, i, L"uR\"")
+		         || i + 3 < buf->size && buf_match_at(buf, i, L"UR\""))
 		{
 			if (!hl_rstring(buf, &i, out_lb, out_ub, out_fg, out_bg))
 				return 0;
@@ -348,12 +346,9 @@ hl_rstring(struct buf const *buf,
 	term_seq[0] = L')';
 	term_seq[d_char_seq_len + 1] = L'"';
 	
-	while (j + d_char_seq_len + 2 < buf->size)
+	while (j + d_char_seq_len + 2 < buf->size
+	       && !buf_match_at(buf, j, term_seq))
 	{
-		wchar_t cmp_buf[19];
-		buf_get_wstr(buf, cmp_buf, j, d_char_seq_len + 3);
-		if (!wcscmp(cmp_buf, term_seq))
-			break;
 		++j;
 	}
 	
@@ -384,12 +379,8 @@ hl_comment(struct buf const *buf,
 	}
 	else
 	{
-		wchar_t cmp[3];
-		while (j + 1 < buf->size
-		       && wcscmp(buf_get_wstr(buf, cmp, j, 3), L"*/"))
-		{
+		while (j + 1 < buf->size && !buf_match_at(buf, j, L"*/"))
 			++j;
-		}
 	}
 	
 	*out_lb = *i;
@@ -474,16 +465,11 @@ hl_word(struct buf const *buf,
 			wt = WT_FUNC;
 	}
 	
+	size_t len = j - *i;
 	for (size_t kw = 0; kw < ARRAY_SIZE(keywords); ++kw)
 	{
-		size_t len = j - *i + 1;
-		if (len > 64)
-			break;
-		
-		wchar_t cmp[64];
-		buf_get_wstr(buf, cmp, *i, len);
-		
-		if (!wcscmp(keywords[kw], cmp))
+		if (wcslen(keywords[kw]) == len
+		    && buf_match_at(buf, *i, keywords[kw]))
 		{
 			wt = WT_KEYWORD;
 			break;
@@ -294,13 +294,8 @@ hl_comment(struct buf const *buf,
 	}
 	else
 	{
-		while (j + 1 < buf->size)
-		{
-			wchar_t cmp[3];
-			if (!wcscmp(buf_get_wstr(buf, cmp, j, 3), L"*/"))
-				break;
+		while (j + 1 < buf->size && !buf_match_at(buf, j, L"*/"))
 			++j;
-		}
 	}
 	
 	*out_lb = *i;
@@ -381,16 +376,11 @@ hl_word(struct buf const *buf,
 	
 	if (!ident_pfx)
 	{
+		size_t len = j - *i;
 		for (size_t kw = 0; kw < ARRAY_SIZE(keywords); ++kw)
 		{
-			size_t len = j - *i + 1;
-			if (len > 64)
-				break;
-			
-			wchar_t cmp[64];
-			buf_get_wstr(buf, cmp, *i, len);
-			
-			if (!wcscmp(keywords[kw], cmp))
+			if (wcslen(keywords[kw]) == len
+			    && buf_match_at(buf, *i, keywords[kw]))
 			{
 				wt = WT_KEYWORD;
 				break;
@@ -26,10 +26,7 @@ hl_html_find(struct buf const *buf,
 {
 	for (size_t i = off; i < buf->size; ++i)
 	{
-		wchar_t cmp[5];
-		
-		if (i + 3 < buf->size
-		    && !wcscmp(buf_get_wstr(buf, cmp, i, 5), L"<!--"))
+		if (i + 3 < buf->size && buf_match_at(buf, i, L"<!--"))
 		{
 			if (!hl_comment(buf, &i, out_lb, out_ub, out_fg, out_bg))
 				return 0;
@@ -106,8 +103,7 @@ hl_comment(struct buf const *buf,
            uint8_t *out_bg)
 {
 	size_t j = *i + 4;
-	wchar_t cmp[4];
-	while (j < buf->size && wcscmp(buf_get_wstr(buf, cmp, j, 4), L"-->"))
+	while (j < buf->size && !buf_match_at(buf, j, L"-->"))
 		++j;
 	
 	if (j == buf->size)
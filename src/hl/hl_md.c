@@ -33,8 +33,6 @@ hl_md_find(struct buf const *buf,
 {
 	for (size_t i = off; i < buf->size; ++i)
 	{
-		wchar_t cmp_buf[4];
-		
 		if (buf_get_wch(buf, i) == L'#')
 		{
 			if (!hl_heading(buf, &i, out_lb, out_ub, out_fg, out_bg))
@@ -45,8 +43,7 @@ hl_md_find(struct buf const *buf,
 			if (!hl_block(buf, &i, out_lb, out_ub, out_fg, out_bg))
 				return 0;
 		}
-		else if (i + 2 < buf->size
-		         && !wcscmp(buf_get_wstr(buf, cmp_buf, i, 4), L"```"))
+		else if (i + 2 < buf->size && buf_match_at(buf, i, L"```"))
 		{
 			if (!hl_code_block(buf, &i, out_lb, out_ub, out_fg, out_bg))
 				return 0;
@@ -84,14 +81,12 @@ hl_code_block(struct buf const *buf,
 	
 	for (size_t j = *i + 3; j + 2 < buf->size; ++j)
 	{
-		wchar_t cmp_buf[4];
-		
 		if (buf_get_wch(buf, j) == L'\\')
 		{
 			++j;
 			continue;
 		}
-		else if (!wcscmp(buf_get_wstr(buf, cmp_buf, j, 4), L"```"))
+		else if (buf_match_at(buf, j, L"```"))
 		{
 			if (first_ln_ch(buf, j) != j)
 				continue;
@@ -209,13 +209,7 @@ hl_rstring(struct buf const *buf,
 	
 	while (j < buf->size)
 	{
-		// probably segfault if 64 or more hashes are used in a raw
-		// string.
-		// this is a non-issue probably not worth fully fixing.
-		// TODO: make this not crash.
-		wchar_t cmp[64];
-		
-		if (!wcscmp(buf_get_wstr(buf, cmp, j, 2 + nhash), search))
+		if (buf_match_at(buf, j, search))
 		{
 			*out_lb = *i;
 			*out_ub = j + nhash + 1;
@@ -295,15 +289,12 @@ hl_blk_comment(struct buf const *buf,
 	size_t j = *i + 2;
 	while (j + 1 < buf->size)
 	{
-		wchar_t cmp_buf[3];
-		buf_get_wstr(buf, cmp_buf, j, 3);
-		
-		if (!wcscmp(cmp_buf, L"*/"))
+		if (buf_match_at(buf, j, L"*/"))
 		{
 			--nopen;
 			++j;
 		}
-		else if (!wcscmp(cmp_buf, L"/*"))
+		else if (buf_match_at(buf, j, L"/*"))
 		{
 			++nopen;
 			++j;
@@ -398,9 +389,7 @@ hl_word(struct buf const *buf,
 		// highlight handling, but noone really ever does that in Rust,
 		// so it is not handled.
 		
-		wchar_t cmp_buf[4];
-		if (k + 2 < buf->size
-		    && !wcscmp(buf_get_wstr(buf, cmp_buf, k, 4), L"::<"))
+		if (k + 2 < buf->size && buf_match_at(buf, k, L"::<"))
 		{
 			k += 3;
 			unsigned nopen = 1;
@@ -417,16 +406,11 @@ hl_word(struct buf const *buf,
 			wt = WT_FUNC;
 	}
 	
+	size_t len = j - *i;
 	for (size_t kw = 0; kw < ARRAY_SIZE(keywords); ++kw)
 	{
-		size_t len = j - *i + 1;
-		if (len > 64)
-			break;
-		
-		wchar_t cmp[64];
-		buf_get_wstr(buf, cmp, *i, len);
-		
-		if (!wcscmp(keywords[kw], cmp))
+		if (wcslen(keywords[kw]) == len
+		    && buf_match_at(buf, *i, keywords[kw]))
 		{
 			wt = WT_KEYWORD;
 			break;
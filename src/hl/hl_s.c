@@ -235,13 +235,8 @@ hl_comment(struct buf const *buf,
 	}
 	else
 	{
-		while (j < buf->size)
-		{
-			wchar_t cmp[3];
-			if (!wcscmp(buf_get_wstr(buf, cmp, j, 3), L"*/"))
-				break;
+		while (j < buf->size && !buf_match_at(buf, j, L"*/"))
 			++j;
-		}
 	}
 	
 	*out_lb = *i;
@@ -333,16 +328,11 @@ hl_word(struct buf const *buf,
 		++j;
 	}
 	
+	size_t len = j - *i;
 	for (size_t reg = 0; reg < ARRAY_SIZE(regs); ++reg)
 	{
-		size_t len = j - *i + 1;
-		if (len > 64)
-			break;
-		
-		wchar_t cmp[64];
-		buf_get_wstr(buf, cmp, *i, len);
-		
-		if (!wcscmp(regs[reg], cmp))
+		if (wcslen(regs[reg]) == len
+		    && buf_match_at(buf, *i, regs[reg]))
 		{
 			wt = WT_REG;
 			break;
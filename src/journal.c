@@ -0,0 +1,471 @@
+#include "journal.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "conf.h"
+#include "utf8.h"
+#include "util.h"
+
+#define JOURNAL_MAGIC "MDJ1"
+
+struct journal
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *path;
+	int fd;
+	
+	// records are appended to `pend` by the editor, and swapped into
+	// `out` by the writer whenever it is due to write them out, so that
+	// neither side waits on the other for long.
+	uint8_t *pend, *out;
+	size_t npend, pend_cap, out_cap;
+	
+	// total number of bytes ever appended, including the header.
+	size_t len, hdr_len;
+	
+	bool closing, discard;
+};
+
+static struct journal *create(char *path, struct timespec mtime, size_t size);
+static void stop(struct journal *j, bool discard);
+static void replace(struct journal *j);
+static void *writer(void *arg);
+static void flush(struct journal *j);
+static uint8_t *reserve(struct journal *j, size_t n);
+static void commit(struct journal *j, uint8_t const *end);
+static uint8_t *read_all(char const *path, size_t *out_n);
+
+struct journal *
+journal_open(char const *src, struct timespec mtime, size_t size)
+{
+	return create(side_path(src, CONF_JOURNAL_SUFFIX), mtime, size);
+}
+
+void
+journal_close(struct journal *j)
+{
+	// the journal is only ever closed once its edits are no longer needed
+	// for recovery, so it is removed along with anything not yet written.
+	stop(j, true);
+	if (j->fd != -1)
+		close(j->fd);
+	unlink(j->path);
+	
+	free(j->path);
+	free(j);
+}
+
+void
+journal_write(struct journal *j, size_t pos, wchar_t const *wstr, size_t len)
+{
+	pthread_mutex_lock(&j->lock);
+	
+	uint8_t *bytes = reserve(j, 1 + 2 * VARINT_MAX + 4 * len);
+	*bytes++ = 'w';
+	bytes = put_varint(bytes, pos);
+	bytes = put_varint(bytes, len);
+	
+	// characters without a valid encoding are replaced rather than being
+	// skipped, which would throw off the positions of later records.
+	for (size_t i = 0; i < len; ++i)
+	{
+		uint8_t *next = utf8_encode_ch(bytes, wstr[i]);
+		bytes = next != bytes ? next : utf8_encode_ch(bytes, 0xfffd);
+	}
+	
+	commit(j, bytes);
+	pthread_mutex_unlock(&j->lock);
+}
+
+void
+journal_erase(struct journal *j, size_t lb, size_t ub)
+{
+	pthread_mutex_lock(&j->lock);
+	
+	uint8_t *bytes = reserve(j, 1 + 2 * VARINT_MAX);
+	*bytes++ = 'e';
+	bytes = put_varint(bytes, lb);
+	bytes = put_varint(bytes, ub - lb);
+	
+	commit(j, bytes);
+	pthread_mutex_unlock(&j->lock);
+}
+
+size_t
+journal_len(struct journal *j)
+{
+	pthread_mutex_lock(&j->lock);
+	size_t len = j->len;
+	pthread_mutex_unlock(&j->lock);
+	
+	return len;
+}
+
+struct journal *
+journal_rebase(struct journal *j, size_t off, struct timespec mtime, size_t size)
+{
+	// everything is written out first, so that the records past `off`
+	// can be read back from the file.
+	stop(j, false);
+	
+	off = off < j->hdr_len ? j->hdr_len : off;
+	size_t ntail = j->len > off ? j->len - off : 0;
+	uint8_t *tail = malloc(ntail + 1);
+	if (j->fd == -1 || pread(j->fd, tail, ntail, off) != (ssize_t)ntail)
+		ntail = 0;
+	
+	if (j->fd != -1)
+		close(j->fd);
+	
+	struct journal *new = create(j->path, mtime, size);
+	free(j);
+	
+	pthread_mutex_lock(&new->lock);
+	uint8_t *bytes = reserve(new, ntail);
+	memcpy(bytes, tail, ntail);
+	commit(new, bytes + ntail);
+	replace(new);
+	pthread_mutex_unlock(&new->lock);
+	
+	free(tail);
+	
+	return new;
+}
+
+enum journal_status
+journal_load(char const *src,
+             struct timespec mtime,
+             size_t size,
+             struct journal_rec **out_recs,
+             size_t *out_nrecs)
+{
+	char *path = side_path(src, CONF_JOURNAL_SUFFIX);
+	size_t n;
+	uint8_t *bytes = read_all(path, &n);
+	free(path);
+	
+	if (!bytes)
+		return JS_NONE;
+	
+	uint8_t const *p = bytes, *end = bytes + n;
+	uint64_t sec, nsec, base_size;
+	if (n < strlen(JOURNAL_MAGIC)
+	    || memcmp(p, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC))
+	    || (p += strlen(JOURNAL_MAGIC), get_varint(&p, end, &sec))
+	    || get_varint(&p, end, &nsec)
+	    || get_varint(&p, end, &base_size))
+	{
+		free(bytes);
+		return JS_STALE;
+	}
+	
+	// the edits only make sense on top of the exact file they were made
+	// to, so the journal is useless once the file has changed.
+	if (sec != (uint64_t)mtime.tv_sec
+	    || nsec != (uint64_t)mtime.tv_nsec
+	    || base_size != size)
+	{
+		free(bytes);
+		return JS_STALE;
+	}
+	
+	struct journal_rec *recs = NULL;
+	size_t nrecs = 0, cap = 0;
+	
+	// a crash may leave the last record partly written, in which case it
+	// and anything after it are dropped.
+	while (p < end)
+	{
+		uint8_t type = *p++;
+		uint64_t a, b;
+		if ((type != 'w' && type != 'e')
+		    || get_varint(&p, end, &a)
+		    || get_varint(&p, end, &b))
+		{
+			break;
+		}
+		
+		struct journal_rec rec =
+		{
+			.lb = a,
+			.ub = type == 'e' ? a + b : a,
+			.wstr = NULL,
+		};
+		
+		if (type == 'w')
+		{
+			if (b > (size_t)(end - p))
+				break;
+			
+			rec.wstr = malloc(sizeof(wchar_t) * (b + 1));
+			size_t i;
+			for (i = 0; i < b; ++i)
+			{
+				int len = utf8_seq_len(*p);
+				if (!len || len > end - p)
+					break;
+				
+				uchar32 ch = utf8_decode_ch(p);
+				rec.wstr[i] = ch == UTF8_BAD_CH ? 0xfffd : ch;
+				p += len;
+			}
+			rec.wstr[i] = 0;
+			
+			if (i < b)
+			{
+				free(rec.wstr);
+				break;
+			}
+		}
+		
+		if (nrecs >= cap)
+		{
+			cap = cap ? 2 * cap : 16;
+			recs = realloc(recs, sizeof(struct journal_rec) * cap);
+		}
+		recs[nrecs++] = rec;
+	}
+	
+	free(bytes);
+	
+	*out_recs = recs;
+	*out_nrecs = nrecs;
+	return JS_OK;
+}
+
+void
+journal_free_recs(struct journal_rec *recs, size_t nrecs)
+{
+	for (size_t i = 0; i < nrecs; ++i)
+		free(recs[i].wstr);
+	free(recs);
+}
+
+void
+journal_discard(char const *src)
+{
+	char *path = side_path(src, CONF_JOURNAL_SUFFIX);
+	unlink(path);
+	free(path);
+}
+
+static struct journal *
+create(char *path, struct timespec mtime, size_t size)
+{
+	struct journal *j = malloc(sizeof(struct journal));
+	*j = (struct journal)
+	{
+		.path = path,
+		.fd = -1,
+		.pend = NULL,
+		.out = NULL,
+		.npend = 0,
+		.pend_cap = 0,
+		.out_cap = 0,
+		.len = 0,
+		.closing = false,
+		.discard = false,
+	};
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->cond, NULL);
+	
+	// the header records which version of the file the edits apply to.
+	uint8_t *bytes = reserve(j, strlen(JOURNAL_MAGIC) + 3 * VARINT_MAX);
+	memcpy(bytes, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC));
+	bytes += strlen(JOURNAL_MAGIC);
+	bytes = put_varint(bytes, mtime.tv_sec);
+	bytes = put_varint(bytes, mtime.tv_nsec);
+	bytes = put_varint(bytes, size);
+	commit(j, bytes);
+	j->hdr_len = j->len;
+	
+	// without a writer, nothing is ever written and the journal just
+	// collects records in memory.
+	if (pthread_create(&j->thread, NULL, writer, j))
+		j->closing = true;
+	
+	return j;
+}
+
+static void
+stop(struct journal *j, bool discard)
+{
+	pthread_mutex_lock(&j->lock);
+	bool running = !j->closing;
+	j->closing = true;
+	j->discard = discard;
+	pthread_cond_signal(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+	
+	if (running)
+		pthread_join(j->thread, NULL);
+	
+	pthread_mutex_destroy(&j->lock);
+	pthread_cond_destroy(&j->cond);
+	free(j->pend);
+	free(j->out);
+}
+
+static void
+replace(struct journal *j)
+{
+	// called with the lock held.
+	// the old journal no longer matches the file, so it is replaced with
+	// the new one straight away rather than whenever the writer gets to
+	// it, as a crash in between would leave it to be found stale.
+	size_t tmp_len = strlen(j->path) + 8;
+	char *tmp = malloc(tmp_len);
+	snprintf(tmp, tmp_len, "%s.XXXXXX", j->path);
+	
+	int fd = mkstemp(tmp);
+	if (fd != -1
+	    && (write_all(fd, j->pend, j->npend)
+	        || fdatasync(fd)
+	        || rename(tmp, j->path)))
+	{
+		close(fd);
+		unlink(tmp);
+		fd = -1;
+	}
+	free(tmp);
+	
+	// failing that, the old journal is still removed, and the writer
+	// creates the new one as it would have otherwise.
+	if (fd == -1)
+	{
+		unlink(j->path);
+		return;
+	}
+	
+	j->fd = fd;
+	j->npend = 0;
+}
+
+static void *
+writer(void *arg)
+{
+	struct journal *j = arg;
+	
+	pthread_mutex_lock(&j->lock);
+	while (!j->closing)
+	{
+		while (!j->npend && !j->closing)
+			pthread_cond_wait(&j->cond, &j->lock);
+		
+		// once there is something to write, more records are given some
+		// time to come in, so that a burst of edits is synced only once.
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += CONF_JOURNAL_INTERVAL / 1000;
+		deadline.tv_nsec += CONF_JOURNAL_INTERVAL % 1000 * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			++deadline.tv_sec;
+			deadline.tv_nsec -= 1000000000;
+		}
+		
+		while (!j->closing && pthread_cond_timedwait(&j->cond, &j->lock, &deadline) != ETIMEDOUT)
+			;
+		
+		if (!j->discard)
+			flush(j);
+	}
+	pthread_mutex_unlock(&j->lock);
+	
+	return NULL;
+}
+
+static void
+flush(struct journal *j)
+{
+	// called with the lock held, which is released while writing.
+	if (!j->npend)
+		return;
+	
+	uint8_t *bytes = j->pend;
+	size_t n = j->npend, cap = j->pend_cap;
+	j->pend = j->out;
+	j->pend_cap = j->out_cap;
+	j->npend = 0;
+	pthread_mutex_unlock(&j->lock);
+	
+	if (j->fd == -1)
+		j->fd = open(j->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	
+	// a journal that cannot be written is of no use, but editing carries
+	// on as normal regardless.
+	if (j->fd != -1 && !write_all(j->fd, bytes, n))
+		fdatasync(j->fd);
+	
+	pthread_mutex_lock(&j->lock);
+	j->out = bytes;
+	j->out_cap = cap;
+}
+
+static uint8_t *
+reserve(struct journal *j, size_t n)
+{
+	if (j->npend + n > j->pend_cap)
+	{
+		j->pend_cap = 2 * (j->npend + n);
+		j->pend = realloc(j->pend, j->pend_cap);
+	}
+	
+	return j->pend + j->npend;
+}
+
+static void
+commit(struct journal *j, uint8_t const *end)
+{
+	size_t n = end - (j->pend + j->npend);
+	
+	// the writer only needs waking for the first pending record, as it
+	// then waits out the interval anyway.
+	if (!j->npend && n)
+		pthread_cond_signal(&j->cond);
+	
+	j->npend += n;
+	j->len += n;
+}
+
+static uint8_t *
+read_all(char const *path, size_t *out_n)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+	
+	size_t n = 0, cap = 4096;
+	uint8_t *bytes = malloc(cap);
+	for (;;)
+	{
+		if (n == cap)
+		{
+			cap *= 2;
+			bytes = realloc(bytes, cap);
+		}
+		
+		ssize_t nread = read(fd, bytes + n, cap - n);
+		if (nread < 0 && errno == EINTR)
+			continue;
+		else if (nread <= 0)
+			break;
+		
+		n += nread;
+	}
+	
+	close(fd);
+	
+	*out_n = n;
+	return bytes;
+}
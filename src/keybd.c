@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <poll.h>
 #include <unistd.h>
 
 #include "conf.h"
@@ -109,6 +110,22 @@ keybd_is_exec_mac(void)
 	return exec_mac;
 }
 
+bool
+keybd_key_pending(void)
+{
+	// the last key of a macro is read from stdin, see
+	// `keybd_await_key_nb()`.
+	if (exec_mac && cur_mac_exec < cur_mac_len - 1)
+		return true;
+	
+	struct pollfd pfd =
+	{
+		.fd = STDIN_FILENO,
+		.events = POLLIN,
+	};
+	return poll(&pfd, 1, 0) > 0 && pfd.revents & POLLIN;
+}
+
 wint_t
 keybd_await_key_nb(void)
 {
@@ -0,0 +1,567 @@
+#include "line_idx.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+// blocks are only partially filled when created, so that lines can be added to
+// them later without immediately needing to split them.
+#define BLK_FILL (3 * LINE_IDX_BLK_CAP / 4)
+
+// text is hashed as a polynomial modulo a Mersenne prime, which lets the
+// hashes of adjacent pieces of text be combined without rereading them.
+#define HASH_MOD 0x1fffffffffffffff
+#define HASH_BASE 0x0f4a7c159e3779b9
+
+// text is read back in pieces of this many characters when hashing.
+#define HASH_READ_SIZE 4096
+
+struct line_loc
+{
+	size_t blk, ind;
+	size_t ln, start;
+};
+
+static struct line_loc find_pos(struct line_idx const *li, size_t pos);
+static struct line_loc find_ln(struct line_idx const *li, size_t ln);
+static void set_len(struct line_idx *li, struct line_loc const *loc, size_t len);
+static void add_lines(struct line_idx *li, struct line_loc const *loc, size_t const *lens, size_t n);
+static void rm_lines(struct line_idx *li, size_t ln, size_t n);
+static void update_blk(struct line_idx *li, size_t blk);
+static void rebuild_tree(struct line_idx *li);
+static size_t dirty_len(struct line_idx const *li, size_t k);
+static void hash_node(struct line_idx *li, size_t k, size_t start, void (*read)(void const *, wchar_t *, size_t, size_t), void const *ctx, wchar_t *tmp);
+static uint64_t mul_mod(uint64_t a, uint64_t b);
+static uint64_t pow_mod(uint64_t a, size_t n);
+
+struct line_idx
+line_idx_create(void)
+{
+	struct line_idx li =
+	{
+		.blks = malloc(sizeof(struct line_blk *)),
+		.nblks = 1,
+		.blks_cap = 1,
+		.tree_cnt = NULL,
+		.tree_sum = NULL,
+		.tree_cap = 0,
+		.tree_hash = NULL,
+		.tree_hash_ok = NULL,
+	};
+	
+	// there is always at least one line, even in empty text.
+	li.blks[0] = calloc(1, sizeof(struct line_blk));
+	li.blks[0]->nlines = 1;
+	rebuild_tree(&li);
+	
+	return li;
+}
+
+void
+line_idx_destroy(struct line_idx *li)
+{
+	for (size_t i = 0; i < li->nblks; ++i)
+		free(li->blks[i]);
+	
+	free(li->blks);
+	free(li->tree_cnt);
+	free(li->tree_sum);
+	free(li->tree_hash);
+	free(li->tree_hash_ok);
+}
+
+void
+line_idx_insert(struct line_idx *li,
+                size_t pos,
+                size_t const *segs,
+                size_t nsegs)
+{
+	// inserted text is described by the lengths of its newline-separated
+	// segments.
+	// every segment except the last one includes its terminating newline.
+	struct line_loc loc = find_pos(li, pos);
+	size_t len = li->blks[loc.blk]->lens[loc.ind];
+	size_t off = pos - loc.start;
+	
+	if (nsegs == 1)
+	{
+		set_len(li, &loc, len + segs[0]);
+		return;
+	}
+	
+	// the remainder of the line being inserted into ends up on the last
+	// newly created line.
+	size_t *new = malloc(sizeof(size_t) * (nsegs - 1));
+	memcpy(new, segs + 1, sizeof(size_t) * (nsegs - 1));
+	new[nsegs - 2] += len - off;
+	
+	set_len(li, &loc, off + segs[0]);
+	add_lines(li, &loc, new, nsegs - 1);
+	
+	free(new);
+}
+
+void
+line_idx_insert_wstr(struct line_idx *li,
+                     size_t pos,
+                     wchar_t const *wstr,
+                     size_t len)
+{
+	size_t nsegs = 1;
+	for (size_t i = 0; i < len; ++i)
+		nsegs += wstr[i] == L'\n';
+	
+	// most insertions are single characters or short strings, which
+	// shouldn't need to allocate anything.
+	size_t segs_buf[16];
+	size_t *segs = nsegs > ARRAY_SIZE(segs_buf) ? malloc(sizeof(size_t) * nsegs) : segs_buf;
+	
+	size_t seg = 0, seg_start = 0;
+	for (size_t i = 0; i < len; ++i)
+	{
+		if (wstr[i] == L'\n')
+		{
+			segs[seg++] = i + 1 - seg_start;
+			seg_start = i + 1;
+		}
+	}
+	segs[seg] = len - seg_start;
+	
+	line_idx_insert(li, pos, segs, nsegs);
+	
+	if (segs != segs_buf)
+		free(segs);
+}
+
+void
+line_idx_erase(struct line_idx *li, size_t lb, size_t ub)
+{
+	if (lb >= ub)
+		return;
+	
+	struct line_loc loc_lb = find_pos(li, lb);
+	struct line_loc loc_ub = find_pos(li, ub);
+	
+	size_t len_lb = li->blks[loc_lb.blk]->lens[loc_lb.ind];
+	size_t len_ub = li->blks[loc_ub.blk]->lens[loc_ub.ind];
+	
+	if (loc_lb.ln == loc_ub.ln)
+	{
+		set_len(li, &loc_lb, len_lb - (ub - lb));
+		return;
+	}
+	
+	// erasing across newlines joins the first and last lines together.
+	set_len(li, &loc_lb, lb - loc_lb.start + loc_ub.start + len_ub - ub);
+	rm_lines(li, loc_lb.ln + 1, loc_ub.ln - loc_lb.ln);
+}
+
+void
+line_idx_pos(struct line_idx const *li,
+             size_t pos,
+             size_t *out_ln,
+             size_t *out_col)
+{
+	pos = MIN(pos, li->tree_sum[1]);
+	
+	struct line_loc loc = find_pos(li, pos);
+	*out_ln = loc.ln;
+	*out_col = pos - loc.start;
+}
+
+size_t
+line_idx_start(struct line_idx const *li, size_t ln)
+{
+	return find_ln(li, ln).start;
+}
+
+size_t
+line_idx_len(struct line_idx const *li, size_t ln)
+{
+	struct line_loc loc = find_ln(li, ln);
+	return li->blks[loc.blk]->lens[loc.ind];
+}
+
+size_t
+line_idx_cnt(struct line_idx const *li)
+{
+	return li->tree_cnt[1];
+}
+
+int
+line_idx_hash(struct line_idx *li,
+              size_t max_rehash,
+              void (*read)(void const *, wchar_t *, size_t, size_t),
+              void const *ctx,
+              uint64_t *out_hash)
+{
+	// the text of changed blocks is read back through `read`, which fills
+	// its destination with the given number of characters starting at the
+	// given position.
+	// nothing is done if more than `max_rehash` characters would need to
+	// be read.
+	if (dirty_len(li, 1) > max_rehash)
+		return 1;
+	
+	wchar_t *tmp = malloc(sizeof(wchar_t) * (HASH_READ_SIZE + 1));
+	hash_node(li, 1, 0, read, ctx, tmp);
+	free(tmp);
+	
+	*out_hash = li->tree_hash[1];
+	return 0;
+}
+
+static struct line_loc
+find_pos(struct line_idx const *li, size_t pos)
+{
+	// positions at or past the end belong to the last line.
+	if (pos >= li->tree_sum[1])
+	{
+		struct line_blk const *b = li->blks[li->nblks - 1];
+		return (struct line_loc)
+		{
+			.blk = li->nblks - 1,
+			.ind = b->nlines - 1,
+			.ln = li->tree_cnt[1] - 1,
+			.start = li->tree_sum[1] - b->lens[b->nlines - 1],
+		};
+	}
+	
+	size_t k = 1, ln = 0, start = 0;
+	while (k < li->tree_cap)
+	{
+		if (pos - start < li->tree_sum[2 * k])
+			k = 2 * k;
+		else
+		{
+			start += li->tree_sum[2 * k];
+			ln += li->tree_cnt[2 * k];
+			k = 2 * k + 1;
+		}
+	}
+	
+	size_t blk = k - li->tree_cap;
+	struct line_blk const *b = li->blks[blk];
+	
+	size_t ind = 0;
+	while (start + b->lens[ind] <= pos)
+	{
+		start += b->lens[ind++];
+		++ln;
+	}
+	
+	return (struct line_loc)
+	{
+		.blk = blk,
+		.ind = ind,
+		.ln = ln,
+		.start = start,
+	};
+}
+
+static struct line_loc
+find_ln(struct line_idx const *li, size_t ln)
+{
+	ln = MIN(ln, li->tree_cnt[1] - 1);
+	
+	size_t k = 1, acc = 0, start = 0;
+	while (k < li->tree_cap)
+	{
+		if (ln - acc < li->tree_cnt[2 * k])
+			k = 2 * k;
+		else
+		{
+			start += li->tree_sum[2 * k];
+			acc += li->tree_cnt[2 * k];
+			k = 2 * k + 1;
+		}
+	}
+	
+	size_t blk = k - li->tree_cap;
+	struct line_blk const *b = li->blks[blk];
+	
+	size_t ind = ln - acc;
+	for (size_t i = 0; i < ind; ++i)
+		start += b->lens[i];
+	
+	return (struct line_loc)
+	{
+		.blk = blk,
+		.ind = ind,
+		.ln = ln,
+		.start = start,
+	};
+}
+
+static void
+set_len(struct line_idx *li, struct line_loc const *loc, size_t len)
+{
+	struct line_blk *b = li->blks[loc->blk];
+	b->sum = b->sum - b->lens[loc->ind] + len;
+	b->lens[loc->ind] = len;
+	update_blk(li, loc->blk);
+}
+
+static void
+add_lines(struct line_idx *li,
+          struct line_loc const *loc,
+          size_t const *lens,
+          size_t n)
+{
+	struct line_blk *b = li->blks[loc->blk];
+	size_t at = loc->ind + 1;
+	
+	if (b->nlines + n <= LINE_IDX_BLK_CAP)
+	{
+		memmove(b->lens + at + n,
+		        b->lens + at,
+		        sizeof(size_t) * (b->nlines - at));
+		memcpy(b->lens + at, lens, sizeof(size_t) * n);
+		
+		for (size_t i = 0; i < n; ++i)
+			b->sum += lens[i];
+		b->nlines += n;
+		
+		update_blk(li, loc->blk);
+		return;
+	}
+	
+	// the new lines don't fit, so they and everything after them in the
+	// block are spread out over new blocks following it.
+	b->hash_ok = false;
+	size_t ntail = b->nlines - at;
+	size_t *tail = malloc(sizeof(size_t) * MAX(ntail, 1));
+	memcpy(tail, b->lens + at, sizeof(size_t) * ntail);
+	
+	for (size_t i = at; i < b->nlines; ++i)
+		b->sum -= b->lens[i];
+	b->nlines = at;
+	
+	size_t nspill = n + ntail;
+	size_t ntop = b->nlines < BLK_FILL ? MIN(BLK_FILL - b->nlines, nspill) : 0;
+	size_t nnew = (nspill - ntop + BLK_FILL - 1) / BLK_FILL;
+	
+	if (li->nblks + nnew > li->blks_cap)
+	{
+		while (li->nblks + nnew > li->blks_cap)
+			li->blks_cap *= 2;
+		li->blks = realloc(li->blks, sizeof(struct line_blk *) * li->blks_cap);
+	}
+	
+	memmove(&li->blks[loc->blk + 1 + nnew],
+	        &li->blks[loc->blk + 1],
+	        sizeof(struct line_blk *) * (li->nblks - loc->blk - 1));
+	li->nblks += nnew;
+	
+	size_t blk = loc->blk;
+	for (size_t i = 0; i < nspill; ++i)
+	{
+		size_t len = i < n ? lens[i] : tail[i - n];
+		
+		if (i == ntop || (i > ntop && (i - ntop) % BLK_FILL == 0))
+		{
+			++blk;
+			li->blks[blk] = calloc(1, sizeof(struct line_blk));
+		}
+		
+		struct line_blk *dst = li->blks[blk];
+		dst->lens[dst->nlines++] = len;
+		dst->sum += len;
+	}
+	
+	free(tail);
+	rebuild_tree(li);
+}
+
+static void
+rm_lines(struct line_idx *li, size_t ln, size_t n)
+{
+	struct line_loc loc = find_ln(li, ln);
+	size_t blk = loc.blk, ind = loc.ind;
+	size_t first_blk = blk;
+	bool emptied = false;
+	
+	while (n > 0 && blk < li->nblks)
+	{
+		struct line_blk *b = li->blks[blk];
+		size_t nrm = MIN(n, b->nlines - ind);
+		
+		for (size_t i = ind; i < ind + nrm; ++i)
+			b->sum -= b->lens[i];
+		
+		memmove(b->lens + ind,
+		        b->lens + ind + nrm,
+		        sizeof(size_t) * (b->nlines - ind - nrm));
+		b->nlines -= nrm;
+		n -= nrm;
+		
+		if (!b->nlines)
+		{
+			free(b);
+			li->blks[blk] = NULL;
+			emptied = true;
+		}
+		else
+			update_blk(li, blk);
+		
+		++blk;
+		ind = 0;
+	}
+	
+	if (!emptied)
+		return;
+	
+	size_t nkeep = first_blk;
+	for (size_t i = first_blk; i < li->nblks; ++i)
+	{
+		if (li->blks[i])
+			li->blks[nkeep++] = li->blks[i];
+	}
+	li->nblks = nkeep;
+	
+	rebuild_tree(li);
+}
+
+static void
+update_blk(struct line_idx *li, size_t blk)
+{
+	size_t k = li->tree_cap + blk;
+	li->tree_cnt[k] = li->blks[blk]->nlines;
+	li->tree_sum[k] = li->blks[blk]->sum;
+	li->tree_hash_ok[k] = li->blks[blk]->hash_ok = false;
+	
+	for (k /= 2; k > 0; k /= 2)
+	{
+		li->tree_cnt[k] = li->tree_cnt[2 * k] + li->tree_cnt[2 * k + 1];
+		li->tree_sum[k] = li->tree_sum[2 * k] + li->tree_sum[2 * k + 1];
+		li->tree_hash_ok[k] = false;
+	}
+}
+
+static void
+rebuild_tree(struct line_idx *li)
+{
+	size_t cap = 1;
+	while (cap < li->nblks)
+		cap *= 2;
+	
+	if (cap != li->tree_cap)
+	{
+		li->tree_cap = cap;
+		li->tree_cnt = realloc(li->tree_cnt, sizeof(size_t) * 2 * cap);
+		li->tree_sum = realloc(li->tree_sum, sizeof(size_t) * 2 * cap);
+		li->tree_hash = realloc(li->tree_hash, sizeof(uint64_t) * 2 * cap);
+		li->tree_hash_ok = realloc(li->tree_hash_ok, sizeof(bool) * 2 * cap);
+	}
+	
+	// blocks keep their hashes when moved around, so only the nodes above
+	// them need to be combined again.
+	for (size_t i = 0; i < cap; ++i)
+	{
+		struct line_blk const *b = i < li->nblks ? li->blks[i] : NULL;
+		li->tree_cnt[cap + i] = b ? b->nlines : 0;
+		li->tree_sum[cap + i] = b ? b->sum : 0;
+		li->tree_hash[cap + i] = b ? b->hash : 0;
+		li->tree_hash_ok[cap + i] = b ? b->hash_ok : true;
+	}
+	
+	for (size_t k = cap - 1; k > 0; --k)
+	{
+		li->tree_cnt[k] = li->tree_cnt[2 * k] + li->tree_cnt[2 * k + 1];
+		li->tree_sum[k] = li->tree_sum[2 * k] + li->tree_sum[2 * k + 1];
+		li->tree_hash_ok[k] = false;
+	}
+}
+
+static size_t
+dirty_len(struct line_idx const *li, size_t k)
+{
+	if (li->tree_hash_ok[k])
+		return 0;
+	else if (k >= li->tree_cap)
+		return li->tree_sum[k];
+	
+	return dirty_len(li, 2 * k) + dirty_len(li, 2 * k + 1);
+}
+
+static void
+hash_node(struct line_idx *li,
+          size_t k,
+          size_t start,
+          void (*read)(void const *, wchar_t *, size_t, size_t),
+          void const *ctx,
+          wchar_t *tmp)
+{
+	if (li->tree_hash_ok[k])
+		return;
+	
+	if (k >= li->tree_cap)
+	{
+		uint64_t hash = 0;
+		for (size_t off = 0; off < li->tree_sum[k]; off += HASH_READ_SIZE)
+		{
+			size_t n = MIN(HASH_READ_SIZE, li->tree_sum[k] - off);
+			read(ctx, tmp, start + off, n);
+			for (size_t i = 0; i < n; ++i)
+			{
+				hash = mul_mod(hash, HASH_BASE) + (uint32_t)tmp[i] + 1;
+				hash = hash >= HASH_MOD ? hash - HASH_MOD : hash;
+			}
+		}
+		
+		struct line_blk *b = li->blks[k - li->tree_cap];
+		b->hash = hash;
+		b->hash_ok = true;
+		li->tree_hash[k] = hash;
+		li->tree_hash_ok[k] = true;
+		return;
+	}
+	
+	// the left half of the text is shifted up past the right half, which
+	// is the same as having hashed both in one go.
+	hash_node(li, 2 * k, start, read, ctx, tmp);
+	hash_node(li, 2 * k + 1, start + li->tree_sum[2 * k], read, ctx, tmp);
+	
+	uint64_t l = mul_mod(li->tree_hash[2 * k], pow_mod(HASH_BASE, li->tree_sum[2 * k + 1]));
+	uint64_t hash = l + li->tree_hash[2 * k + 1];
+	li->tree_hash[k] = hash >= HASH_MOD ? hash - HASH_MOD : hash;
+	li->tree_hash_ok[k] = true;
+}
+
+static uint64_t
+mul_mod(uint64_t a, uint64_t b)
+{
+	// the full product is put together out of 32-bit halves, and folded
+	// back down using 2^61 being congruent to 1.
+	uint64_t a_hi = a >> 32, a_lo = a & 0xffffffff;
+	uint64_t b_hi = b >> 32, b_lo = b & 0xffffffff;
+	uint64_t lo = a_lo * b_lo;
+	uint64_t mid = a_hi * b_lo + a_lo * b_hi;
+	uint64_t hi = a_hi * b_hi;
+	
+	uint64_t r = (lo & HASH_MOD)
+	             + (lo >> 61)
+	             + (hi << 3)
+	             + (mid >> 29)
+	             + ((mid & 0x1fffffff) << 32);
+	r = (r & HASH_MOD) + (r >> 61);
+	r = (r & HASH_MOD) + (r >> 61);
+	
+	return r >= HASH_MOD ? r - HASH_MOD : r;
+}
+
+static uint64_t
+pow_mod(uint64_t a, size_t n)
+{
+	uint64_t r = 1;
+	for (; n; n >>= 1)
+	{
+		if (n & 1)
+			r = mul_mod(r, a);
+		a = mul_mod(a, a);
+	}
+	
+	return r;
+}
@@ -0,0 +1,298 @@
+#include "mark.h"
+
+#include <stdlib.h>
+
+static size_t alloc_node(struct mark_tree *mt, size_t pos);
+static void apply(struct mark_tree *mt, size_t node, bool set, size_t set_pos, size_t add);
+static void push(struct mark_tree *mt, size_t node);
+static void push_path(struct mark_tree *mt, size_t node);
+static void set_l(struct mark_tree *mt, size_t node, size_t child);
+static void set_r(struct mark_tree *mt, size_t node, size_t child);
+static void split(struct mark_tree *mt, size_t node, size_t pos, size_t *out_l, size_t *out_r);
+static size_t merge(struct mark_tree *mt, size_t l, size_t r);
+static void attach(struct mark_tree *mt, size_t node);
+static void detach(struct mark_tree *mt, size_t node);
+
+struct mark_tree
+mark_tree_create(void)
+{
+	return (struct mark_tree)
+	{
+		.nodes = NULL,
+		.nnodes = 0,
+		.cap = 0,
+		.root = MARK_NIL,
+		.free = MARK_NIL,
+	};
+}
+
+void
+mark_tree_destroy(struct mark_tree *mt)
+{
+	free(mt->nodes);
+}
+
+size_t
+mark_tree_add(struct mark_tree *mt, size_t pos)
+{
+	size_t node = alloc_node(mt, pos);
+	attach(mt, node);
+	return node;
+}
+
+void
+mark_tree_rm(struct mark_tree *mt, size_t mark)
+{
+	detach(mt, mark);
+	
+	// removed nodes are chained through their left child until reused.
+	mt->nodes[mark].l = mt->free;
+	mt->free = mark;
+}
+
+size_t
+mark_tree_get(struct mark_tree const *mt, size_t mark)
+{
+	// ancestors further up hold more recent tags than those below them,
+	// so they are applied going upwards.
+	size_t pos = mt->nodes[mark].pos;
+	for (size_t p = mt->nodes[mark].parent; p != MARK_NIL; p = mt->nodes[p].parent)
+	{
+		struct mark_node const *n = &mt->nodes[p];
+		pos = n->set ? n->set_pos : pos + n->add;
+	}
+	
+	return pos;
+}
+
+void
+mark_tree_put(struct mark_tree *mt, size_t mark, size_t pos)
+{
+	detach(mt, mark);
+	mt->nodes[mark].pos = pos;
+	attach(mt, mark);
+}
+
+void
+mark_tree_insert(struct mark_tree *mt, size_t pos, size_t n)
+{
+	// marks sitting exactly at the insertion point stay in front of the
+	// inserted text.
+	size_t l, r;
+	split(mt, mt->root, pos + 1, &l, &r);
+	apply(mt, r, false, 0, n);
+	mt->root = merge(mt, l, r);
+}
+
+void
+mark_tree_erase(struct mark_tree *mt, size_t lb, size_t ub)
+{
+	if (lb >= ub)
+		return;
+	
+	// marks inside the erased region collapse onto its start, which keeps
+	// the tree ordered since everything after it moves back by the same
+	// amount.
+	size_t l, m, r;
+	split(mt, mt->root, lb, &l, &r);
+	split(mt, r, ub, &m, &r);
+	apply(mt, m, true, lb, 0);
+	apply(mt, r, false, 0, -(ub - lb));
+	mt->root = merge(mt, l, merge(mt, m, r));
+}
+
+static size_t
+alloc_node(struct mark_tree *mt, size_t pos)
+{
+	size_t node;
+	if (mt->free != MARK_NIL)
+	{
+		node = mt->free;
+		mt->free = mt->nodes[node].l;
+	}
+	else
+	{
+		if (mt->nnodes >= mt->cap)
+		{
+			mt->cap = mt->cap ? 2 * mt->cap : 4;
+			mt->nodes = realloc(mt->nodes, sizeof(struct mark_node) * mt->cap);
+		}
+		node = mt->nnodes++;
+	}
+	
+	// a small xorshift generator is plenty for picking treap priorities.
+	static uint32_t seed = 2463534242;
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	
+	mt->nodes[node] = (struct mark_node)
+	{
+		.pos = pos,
+		.l = MARK_NIL,
+		.r = MARK_NIL,
+		.parent = MARK_NIL,
+		.prio = seed,
+		.add = 0,
+		.set_pos = 0,
+		.set = false,
+	};
+	
+	return node;
+}
+
+static void
+apply(struct mark_tree *mt, size_t node, bool set, size_t set_pos, size_t add)
+{
+	if (node == MARK_NIL)
+		return;
+	
+	struct mark_node *n = &mt->nodes[node];
+	if (set)
+	{
+		n->pos = set_pos;
+		n->set = true;
+		n->set_pos = set_pos;
+		n->add = 0;
+	}
+	
+	n->pos += add;
+	if (n->set)
+		n->set_pos += add;
+	else
+		n->add += add;
+}
+
+static void
+push(struct mark_tree *mt, size_t node)
+{
+	struct mark_node *n = &mt->nodes[node];
+	if (!n->set && n->add == 0)
+		return;
+	
+	apply(mt, n->l, n->set, n->set_pos, n->add);
+	apply(mt, n->r, n->set, n->set_pos, n->add);
+	n->set = false;
+	n->add = 0;
+}
+
+static void
+push_path(struct mark_tree *mt, size_t node)
+{
+	if (mt->nodes[node].parent != MARK_NIL)
+		push_path(mt, mt->nodes[node].parent);
+	push(mt, node);
+}
+
+static void
+set_l(struct mark_tree *mt, size_t node, size_t child)
+{
+	mt->nodes[node].l = child;
+	if (child != MARK_NIL)
+		mt->nodes[child].parent = node;
+}
+
+static void
+set_r(struct mark_tree *mt, size_t node, size_t child)
+{
+	mt->nodes[node].r = child;
+	if (child != MARK_NIL)
+		mt->nodes[child].parent = node;
+}
+
+static void
+split(struct mark_tree *mt,
+      size_t node,
+      size_t pos,
+      size_t *out_l,
+      size_t *out_r)
+{
+	// marks before `pos` end up in the left tree, and all others in the
+	// right tree.
+	if (node == MARK_NIL)
+	{
+		*out_l = *out_r = MARK_NIL;
+		return;
+	}
+	
+	push(mt, node);
+	mt->nodes[node].parent = MARK_NIL;
+	
+	size_t l, r;
+	if (mt->nodes[node].pos < pos)
+	{
+		split(mt, mt->nodes[node].r, pos, &l, &r);
+		set_r(mt, node, l);
+		*out_l = node;
+		*out_r = r;
+	}
+	else
+	{
+		split(mt, mt->nodes[node].l, pos, &l, &r);
+		set_l(mt, node, r);
+		*out_l = l;
+		*out_r = node;
+	}
+	
+	if (*out_l != MARK_NIL)
+		mt->nodes[*out_l].parent = MARK_NIL;
+	if (*out_r != MARK_NIL)
+		mt->nodes[*out_r].parent = MARK_NIL;
+}
+
+static size_t
+merge(struct mark_tree *mt, size_t l, size_t r)
+{
+	// every mark in `l` must be at or before every mark in `r`.
+	if (l == MARK_NIL)
+		return r;
+	if (r == MARK_NIL)
+		return l;
+	
+	if (mt->nodes[l].prio > mt->nodes[r].prio)
+	{
+		push(mt, l);
+		set_r(mt, l, merge(mt, mt->nodes[l].r, r));
+		mt->nodes[l].parent = MARK_NIL;
+		return l;
+	}
+	else
+	{
+		push(mt, r);
+		set_l(mt, r, merge(mt, l, mt->nodes[r].l));
+		mt->nodes[r].parent = MARK_NIL;
+		return r;
+	}
+}
+
+static void
+attach(struct mark_tree *mt, size_t node)
+{
+	size_t l, r;
+	split(mt, mt->root, mt->nodes[node].pos, &l, &r);
+	mt->root = merge(mt, merge(mt, l, node), r);
+}
+
+static void
+detach(struct mark_tree *mt, size_t node)
+{
+	push_path(mt, node);
+	
+	struct mark_node *n = &mt->nodes[node];
+	size_t parent = n->parent;
+	size_t sub = merge(mt, n->l, n->r);
+	
+	if (parent == MARK_NIL)
+	{
+		mt->root = sub;
+		if (sub != MARK_NIL)
+			mt->nodes[sub].parent = MARK_NIL;
+	}
+	else if (mt->nodes[parent].l == node)
+		set_l(mt, parent, sub);
+	else
+		set_r(mt, parent, sub);
+	
+	n = &mt->nodes[node];
+	n->l = n->r = n->parent = MARK_NIL;
+}
@@ -72,23 +72,23 @@ bind_new_line(void)
 	
 	if (mf->csr > 0)
 	{
-		wchar_t cmp_buf[3];
-		buf_get_wstr(mf->buf, cmp_buf, mf->csr - 1, 3);
-		
-		if (!wcscmp(L"()", cmp_buf)
-		    || !wcscmp(L"[]", cmp_buf)
-		    || !wcscmp(L"{}", cmp_buf))
+		size_t pos = mf->csr - 1;
+		if (buf_match_at(mf->buf, pos, L"()")
+		    || buf_match_at(mf->buf, pos, L"[]")
+		    || buf_match_at(mf->buf, pos, L"{}"))
 		{
 			expand_pair(ntab);
 			return;
 		}
 	}
 	
+	buf_txn_begin(mf->buf);
 	buf_write_wch(mf->buf, mf->csr, L'\n');
 	for (unsigned i = 0; i < ntab; ++i)
 		buf_write_wch(mf->buf, mf->csr + 1 + i, L'\t');
 	for (unsigned i = 0; i < nspace; ++i)
 		buf_write_wch(mf->buf, mf->csr + 1 + ntab + i, L' ');
+	buf_txn_end(mf->buf);
 	
 	++mf->csr;
 	mf->csr_want_col = ntab + nspace;
@@ -137,6 +137,7 @@ expand_pair(unsigned ntab)
 {
 	size_t write_pos = mf->csr;
 	
+	buf_txn_begin(mf->buf);
 	buf_write_wch(mf->buf, write_pos++, L'\n');
 	for (unsigned i = 0; i < ntab + 1; ++i)
 		buf_write_wch(mf->buf, write_pos++, L'\t');
@@ -144,6 +145,7 @@ expand_pair(unsigned ntab)
 	buf_write_wch(mf->buf, write_pos++, L'\n');
 	for (unsigned i = 0; i < ntab; ++i)
 		buf_write_wch(mf->buf, write_pos++, L'\t');
+	buf_txn_end(mf->buf);
 	
 	mf->csr += 2;
 	frame_mv_csr_rel(mf, 0, ntab + 1, false);
@@ -128,6 +128,7 @@ ask_again:;
 	cls_tag[cls_tag_len] = 0;
 	
 	size_t open_off = mf->csr;
+	buf_txn_begin(mf->buf);
 	buf_write_wch(mf->buf, open_off, L'<');
 	++open_off;
 	buf_write_wstr(mf->buf, open_off, tag);
@@ -142,6 +143,7 @@ ask_again:;
 	cls_off += cls_tag_len;
 	buf_write_wch(mf->buf, cls_off, L'>');
 	++cls_off;
+	buf_txn_end(mf->buf);
 	
 	frame_mv_csr_rel(mf, 0, open_off - mf->csr, false);
 }
@@ -186,15 +186,14 @@ bind_del_back_ch(void)
 		    && mf->buf->size > 1
 		    && mf->csr < mf->buf->size - 1)
 		{
-			wchar_t cmp_buf[3];
-			buf_get_wstr(mf->buf, cmp_buf, mf->csr, 3);
-			
-			if (!wcscmp(cmp_buf, L"()") && (pair_flags & PF_PAREN)
-			    || !wcscmp(cmp_buf, L"[]") && (pair_flags & PF_BRACKET)
-			    || !wcscmp(cmp_buf, L"{}") && (pair_flags & PF_BRACE)
-			    || !wcscmp(cmp_buf, L"<>") && (pair_flags & PF_ANGLE)
-			    || !wcscmp(cmp_buf, L"\"\"") && (pair_flags & PF_DQUOTE)
-			    || !wcscmp(cmp_buf, L"''") && (pair_flags & PF_SQUOTE))
+			struct buf const *b = mf->buf;
+			size_t pos = mf->csr;
+			if (buf_match_at(b, pos, L"()") && (pair_flags & PF_PAREN)
+			    || buf_match_at(b, pos, L"[]") && (pair_flags & PF_BRACKET)
+			    || buf_match_at(b, pos, L"{}") && (pair_flags & PF_BRACE)
+			    || buf_match_at(b, pos, L"<>") && (pair_flags & PF_ANGLE)
+			    || buf_match_at(b, pos, L"\"\"") && (pair_flags & PF_DQUOTE)
+			    || buf_match_at(b, pos, L"''") && (pair_flags & PF_SQUOTE))
 			{
 				nch = 2;
 			}
@@ -0,0 +1,399 @@
+#include "piece.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "utf8.h"
+#include "util.h"
+
+static size_t find_piece(struct piece_tab const *pt, size_t ind, size_t *out_start);
+static size_t split_at(struct piece_tab *pt, size_t ind);
+static void add_pieces(struct piece_tab *pt, size_t ind, struct piece const *new, size_t n);
+static void append_add(struct piece_tab *pt, wchar_t const *wstr, size_t len, uint32_t *out_src, size_t *out_off);
+static size_t orig_byte(struct piece_tab const *pt, size_t ch);
+
+int
+piece_tab_create(struct piece_tab *out, int fd, size_t size, size_t *out_valid)
+{
+	*out = (struct piece_tab)
+	{
+		.map = NULL,
+		.map_size = size,
+		.orig_len = 0,
+		.ckpts = NULL,
+		.ascii = true,
+		.add_chunks = NULL,
+		.nadd_chunks = 0,
+		.pieces = malloc(sizeof(struct piece)),
+		.npieces = 0,
+		.cap = 1,
+		.cache = calloc(1, sizeof(struct piece_cache)),
+	};
+	
+	if (size)
+	{
+		void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+		{
+			free(out->pieces);
+			free(out->cache);
+			return 1;
+		}
+		out->map = map;
+	}
+	
+	// anything past the first invalid sequence is dropped, as is done when
+	// reading a file normally.
+	size_t valid = utf8_validate(out->map, size, &out->orig_len);
+	if (out_valid)
+		*out_valid = valid;
+	
+	// in a pure ASCII file, character and byte offsets coincide, so no
+	// checkpoints need to be stored at all.
+	out->ascii = out->orig_len == valid;
+	if (!out->ascii)
+	{
+		size_t nckpts = (out->orig_len + PIECE_CKPT_GAP - 1) / PIECE_CKPT_GAP;
+		out->ckpts = malloc(sizeof(size_t) * MAX(nckpts, 1));
+		
+		for (size_t i = 0, ch = 0; i < valid; ++i)
+		{
+			if ((out->map[i] & 0xc0) == 0x80)
+				continue;
+			
+			if (ch % PIECE_CKPT_GAP == 0)
+				out->ckpts[ch / PIECE_CKPT_GAP] = i;
+			++ch;
+		}
+	}
+	
+	if (out->orig_len)
+	{
+		out->pieces[0] = (struct piece)
+		{
+			.off = 0,
+			.len = out->orig_len,
+			.src = PS_ORIG,
+		};
+		out->npieces = 1;
+	}
+	
+	return 0;
+}
+
+void
+piece_tab_destroy(struct piece_tab *pt)
+{
+	if (pt->map)
+		munmap((void *)pt->map, pt->map_size);
+	
+	free(pt->ckpts);
+	
+	for (size_t i = 0; i < pt->nadd_chunks; ++i)
+		free(pt->add_chunks[i].data);
+	free(pt->add_chunks);
+	
+	free(pt->pieces);
+	free(pt->cache);
+}
+
+void
+piece_tab_snap(struct piece_tab const *pt, struct piece_tab *out)
+{
+	// the mapping and the used parts of the add chunks are never modified,
+	// so they can be shared with the snapshot, and only the piece list and
+	// chunk descriptors need to be copied.
+	*out = *pt;
+	
+	out->add_chunks = malloc(sizeof(struct piece_chunk) * MAX(pt->nadd_chunks, 1));
+	memcpy(out->add_chunks, pt->add_chunks, sizeof(struct piece_chunk) * pt->nadd_chunks);
+	
+	out->pieces = malloc(sizeof(struct piece) * MAX(pt->npieces, 1));
+	memcpy(out->pieces, pt->pieces, sizeof(struct piece) * pt->npieces);
+	out->cap = MAX(pt->npieces, 1);
+	
+	out->cache = calloc(1, sizeof(struct piece_cache));
+}
+
+void
+piece_tab_snap_destroy(struct piece_tab *pt)
+{
+	free(pt->add_chunks);
+	free(pt->pieces);
+	free(pt->cache);
+}
+
+wchar_t
+piece_tab_get(struct piece_tab const *pt, size_t ind)
+{
+	size_t start;
+	size_t p = find_piece(pt, ind, &start);
+	if (p >= pt->npieces)
+		return 0;
+	
+	struct piece const *pc = &pt->pieces[p];
+	size_t off = pc->off + ind - start;
+	
+	if (pc->src != PS_ORIG)
+		return pt->add_chunks[pc->src - PS_ADD].data[off];
+	
+	return utf8_decode_ch(pt->map + orig_byte(pt, off));
+}
+
+void
+piece_tab_read(struct piece_tab const *pt, wchar_t *dst, size_t ind, size_t n)
+{
+	while (n > 0)
+	{
+		size_t start;
+		size_t p = find_piece(pt, ind, &start);
+		if (p >= pt->npieces)
+			return;
+		
+		struct piece const *pc = &pt->pieces[p];
+		size_t off = pc->off + ind - start;
+		size_t ncpy = MIN(n, pc->len - (ind - start));
+		
+		if (pc->src != PS_ORIG)
+		{
+			wchar_t const *src = pt->add_chunks[pc->src - PS_ADD].data;
+			memcpy(dst, src + off, sizeof(wchar_t) * ncpy);
+		}
+		else
+		{
+			size_t byte = orig_byte(pt, off);
+			for (size_t i = 0; i < ncpy; ++i)
+			{
+				dst[i] = utf8_decode_ch(pt->map + byte);
+				byte += utf8_seq_len(pt->map[byte]);
+			}
+		}
+		
+		dst += ncpy;
+		ind += ncpy;
+		n -= ncpy;
+	}
+}
+
+size_t
+piece_tab_span(struct piece_tab const *pt,
+               size_t ind,
+               void const **out_data,
+               unsigned char *out_width)
+{
+	size_t start;
+	size_t p = find_piece(pt, ind, &start);
+	if (p >= pt->npieces)
+		return 0;
+	
+	struct piece const *pc = &pt->pieces[p];
+	size_t off = pc->off + ind - start;
+	
+	if (pc->src != PS_ORIG)
+	{
+		*out_data = pt->add_chunks[pc->src - PS_ADD].data + off;
+		*out_width = sizeof(wchar_t);
+	}
+	else if (pt->ascii)
+	{
+		*out_data = pt->map + off;
+		*out_width = 1;
+	}
+	else
+	{
+		// characters of non-ASCII original text vary in length, so
+		// there is no fixed-width run to hand out.
+		return 0;
+	}
+	
+	return pc->len - (ind - start);
+}
+
+void
+piece_tab_insert(struct piece_tab *pt,
+                 size_t ind,
+                 wchar_t const *wstr,
+                 size_t len)
+{
+	if (!len)
+		return;
+	
+	uint32_t src;
+	size_t off;
+	append_add(pt, wstr, len, &src, &off);
+	
+	size_t p = split_at(pt, ind);
+	
+	// sequential typing keeps extending the same piece, rather than
+	// creating a new one for every character.
+	struct piece *prev = p > 0 ? &pt->pieces[p - 1] : NULL;
+	if (prev && prev->src == src && prev->off + prev->len == off)
+	{
+		pt->cache->piece = p - 1;
+		pt->cache->piece_start = ind - prev->len;
+		prev->len += len;
+		return;
+	}
+	
+	struct piece new =
+	{
+		.off = off,
+		.len = len,
+		.src = src,
+	};
+	add_pieces(pt, p, &new, 1);
+	
+	pt->cache->piece = p;
+	pt->cache->piece_start = ind;
+}
+
+void
+piece_tab_erase(struct piece_tab *pt, size_t lb, size_t ub)
+{
+	if (lb >= ub)
+		return;
+	
+	size_t plb = split_at(pt, lb);
+	size_t pub = split_at(pt, ub);
+	
+	memmove(&pt->pieces[plb],
+	        &pt->pieces[pub],
+	        sizeof(struct piece) * (pt->npieces - pub));
+	pt->npieces -= pub - plb;
+	
+	pt->cache->piece = plb;
+	pt->cache->piece_start = lb;
+}
+
+static size_t
+find_piece(struct piece_tab const *pt, size_t ind, size_t *out_start)
+{
+	struct piece_cache *c = pt->cache;
+	size_t p = c->piece, start = c->piece_start;
+	
+	if (p > pt->npieces)
+		p = start = 0;
+	
+	while (p > 0 && ind < start)
+	{
+		--p;
+		start -= pt->pieces[p].len;
+	}
+	
+	while (p < pt->npieces && ind >= start + pt->pieces[p].len)
+	{
+		start += pt->pieces[p].len;
+		++p;
+	}
+	
+	c->piece = p;
+	c->piece_start = start;
+	
+	*out_start = start;
+	return p;
+}
+
+static size_t
+split_at(struct piece_tab *pt, size_t ind)
+{
+	size_t start;
+	size_t p = find_piece(pt, ind, &start);
+	if (p >= pt->npieces || ind == start)
+		return p;
+	
+	struct piece *pc = &pt->pieces[p];
+	size_t o = ind - start;
+	
+	struct piece right =
+	{
+		.off = pc->off + o,
+		.len = pc->len - o,
+		.src = pc->src,
+	};
+	pc->len = o;
+	add_pieces(pt, p + 1, &right, 1);
+	
+	return p + 1;
+}
+
+static void
+add_pieces(struct piece_tab *pt,
+           size_t ind,
+           struct piece const *new,
+           size_t n)
+{
+	if (pt->npieces + n > pt->cap)
+	{
+		while (pt->npieces + n > pt->cap)
+			pt->cap *= 2;
+		pt->pieces = realloc(pt->pieces, sizeof(struct piece) * pt->cap);
+	}
+	
+	memmove(&pt->pieces[ind + n],
+	        &pt->pieces[ind],
+	        sizeof(struct piece) * (pt->npieces - ind));
+	memcpy(&pt->pieces[ind], new, sizeof(struct piece) * n);
+	pt->npieces += n;
+}
+
+static void
+append_add(struct piece_tab *pt,
+           wchar_t const *wstr,
+           size_t len,
+           uint32_t *out_src,
+           size_t *out_off)
+{
+	struct piece_chunk *last = pt->nadd_chunks ? &pt->add_chunks[pt->nadd_chunks - 1] : NULL;
+	
+	if (!last || last->cap - last->used < len)
+	{
+		pt->add_chunks = realloc(pt->add_chunks, sizeof(struct piece_chunk) * (pt->nadd_chunks + 1));
+		last = &pt->add_chunks[pt->nadd_chunks++];
+		
+		last->cap = MAX(PIECE_ADD_CHUNK_SIZE, len);
+		last->used = 0;
+		last->data = malloc(sizeof(wchar_t) * last->cap);
+	}
+	
+	memcpy(last->data + last->used, wstr, sizeof(wchar_t) * len);
+	
+	*out_src = PS_ADD + pt->nadd_chunks - 1;
+	*out_off = last->used;
+	
+	last->used += len;
+}
+
+static size_t
+orig_byte(struct piece_tab const *pt, size_t ch)
+{
+	if (pt->ascii)
+		return ch;
+	
+	// walk forward from either the last decoded position or the nearest
+	// checkpoint, whichever is closer.
+	struct piece_cache *c = pt->cache;
+	size_t cur_ch, cur_byte;
+	if (ch >= c->ch && ch - c->ch < PIECE_CKPT_GAP)
+	{
+		cur_ch = c->ch;
+		cur_byte = c->byte;
+	}
+	else
+	{
+		cur_ch = ch - ch % PIECE_CKPT_GAP;
+		cur_byte = pt->ckpts[ch / PIECE_CKPT_GAP];
+	}
+	
+	while (cur_ch < ch)
+	{
+		cur_byte += utf8_seq_len(pt->map[cur_byte]);
+		++cur_ch;
+	}
+	
+	c->ch = cur_ch;
+	c->byte = cur_byte;
+	
+	return cur_byte;
+}
@@ -1,5 +1,16 @@
 #include "utf8.h"
 
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static size_t ascii_prefix(uint8_t const *bytes, size_t n);
+static size_t decode_ascii(uchar32 *out_str, uint8_t const *bytes, size_t n);
+static size_t encode_ascii(uint8_t *out_bytes, uchar32 const *str, size_t n);
+static int seq_valid(uint8_t const *bytes, size_t n);
+
 int
 uc32scmp(uchar32 const *lhs, uchar32 const *rhs)
 {
@@ -65,14 +76,292 @@ utf8_decode_ch(uint8_t const *bytes)
 uint8_t *
 utf8_encode_ch(uint8_t *out_bytes, uchar32 ch)
 {
+	// surrogates and codepoints past U+10FFFF have no valid encoding, so
+	// nothing is written for them.
+	if (ch < 0x80)
+		*out_bytes++ = ch;
+	else if (ch < 0x800)
+	{
+		*out_bytes++ = 0xc0 | ch >> 6;
+		*out_bytes++ = 0x80 | (ch & 0x3f);
+	}
+	else if (ch < 0x10000)
+	{
+		if (ch >= 0xd800 && ch < 0xe000)
+			return out_bytes;
+		
+		*out_bytes++ = 0xe0 | ch >> 12;
+		*out_bytes++ = 0x80 | (ch >> 6 & 0x3f);
+		*out_bytes++ = 0x80 | (ch & 0x3f);
+	}
+	else if (ch < 0x110000)
+	{
+		*out_bytes++ = 0xf0 | ch >> 18;
+		*out_bytes++ = 0x80 | (ch >> 12 & 0x3f);
+		*out_bytes++ = 0x80 | (ch >> 6 & 0x3f);
+		*out_bytes++ = 0x80 | (ch & 0x3f);
+	}
+	
+	return out_bytes;
 }
 
 int
 utf8_decode_str(uchar32 *out_str, uint8_t const *bytes)
 {
+	size_t n = strlen((char const *)bytes), nch;
+	size_t valid = utf8_decode_buf(out_str, bytes, n, &nch);
+	out_str[nch] = 0;
+	
+	return valid != n;
 }
 
 int
 utf8_encode_str(uint8_t *out_bytes, uchar32 const *str)
 {
+	size_t n = 0;
+	while (str[n])
+		++n;
+	
+	size_t nbytes = utf8_encode_buf(out_bytes, str, n);
+	out_bytes[nbytes] = 0;
+	
+	return nbytes;
+}
+
+size_t
+utf8_validate(uint8_t const *bytes, size_t n, size_t *out_nch)
+{
+	size_t i = 0, nch = 0;
+	
+	while (i < n)
+	{
+		size_t nascii = ascii_prefix(bytes + i, n - i);
+		i += nascii;
+		nch += nascii;
+		
+		if (i >= n)
+			break;
+		
+		int len = seq_valid(bytes + i, n - i);
+		if (!len)
+			break;
+		
+		i += len;
+		++nch;
+	}
+	
+	if (out_nch)
+		*out_nch = nch;
+	
+	return i;
+}
+
+size_t
+utf8_decode_buf(uchar32 *out_str, uint8_t const *bytes, size_t n, size_t *out_nch)
+{
+	size_t i = 0, nch = 0;
+	
+	while (i < n)
+	{
+		size_t nascii = decode_ascii(out_str + nch, bytes + i, n - i);
+		i += nascii;
+		nch += nascii;
+		
+		if (i >= n)
+			break;
+		
+		int len = seq_valid(bytes + i, n - i);
+		if (!len)
+			break;
+		
+		out_str[nch++] = utf8_decode_ch(bytes + i);
+		i += len;
+	}
+	
+	if (out_nch)
+		*out_nch = nch;
+	
+	return i;
+}
+
+size_t
+utf8_encode_buf(uint8_t *out_bytes, uchar32 const *str, size_t n)
+{
+	// `out_bytes` needs space for up to four bytes per character.
+	size_t i = 0, nbytes = 0;
+	
+	while (i < n)
+	{
+		size_t nascii = encode_ascii(out_bytes + nbytes, str + i, n - i);
+		i += nascii;
+		nbytes += nascii;
+		
+		if (i >= n)
+			break;
+		
+		uint8_t *end = utf8_encode_ch(out_bytes + nbytes, str[i++]);
+		nbytes = end - out_bytes;
+	}
+	
+	return nbytes;
+}
+
+int
+utf8_seq_len(uint8_t lead)
+{
+	// returns 0 for continuation bytes and leads which can never appear in
+	// valid UTF-8.
+	if (lead < 0x80)
+		return 1;
+	else if (lead >= 0xc2 && lead < 0xe0)
+		return 2;
+	else if (lead >= 0xe0 && lead < 0xf0)
+		return 3;
+	else if (lead >= 0xf0 && lead < 0xf5)
+		return 4;
+	else
+		return 0;
+}
+
+static size_t
+ascii_prefix(uint8_t const *bytes, size_t n)
+{
+	// plain ASCII is checked in bulk, since most text will consist almost
+	// entirely of it.
+	size_t i = 0;
+	
+#ifdef __SSE2__
+	while (i + 16 <= n)
+	{
+		__m128i v = _mm_loadu_si128((__m128i const *)(bytes + i));
+		if (_mm_movemask_epi8(v))
+			break;
+		i += 16;
+	}
+#endif
+	
+	while (i + 8 <= n)
+	{
+		uint64_t word;
+		memcpy(&word, bytes + i, 8);
+		if (word & 0x8080808080808080)
+			break;
+		i += 8;
+	}
+	
+	while (i < n && bytes[i] < 0x80)
+		++i;
+	
+	return i;
+}
+
+static size_t
+decode_ascii(uchar32 *out_str, uint8_t const *bytes, size_t n)
+{
+	size_t i = 0;
+	
+#ifdef __SSE2__
+	// ASCII runs are widened to 32 bits sixteen bytes at a time.
+	__m128i zero = _mm_setzero_si128();
+	while (i + 16 <= n)
+	{
+		__m128i v = _mm_loadu_si128((__m128i const *)(bytes + i));
+		if (_mm_movemask_epi8(v))
+			break;
+		
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+		_mm_storeu_si128((__m128i *)(out_str + i), _mm_unpacklo_epi16(lo, zero));
+		_mm_storeu_si128((__m128i *)(out_str + i + 4), _mm_unpackhi_epi16(lo, zero));
+		_mm_storeu_si128((__m128i *)(out_str + i + 8), _mm_unpacklo_epi16(hi, zero));
+		_mm_storeu_si128((__m128i *)(out_str + i + 12), _mm_unpackhi_epi16(hi, zero));
+		i += 16;
+	}
+#endif
+	
+	while (i < n && bytes[i] < 0x80)
+	{
+		out_str[i] = bytes[i];
+		++i;
+	}
+	
+	return i;
+}
+
+static size_t
+encode_ascii(uint8_t *out_bytes, uchar32 const *str, size_t n)
+{
+	size_t i = 0;
+	
+#ifdef __SSE2__
+	// ASCII runs are narrowed to bytes sixteen characters at a time.
+	__m128i zero = _mm_setzero_si128();
+	__m128i hi_mask = _mm_set1_epi32(~0x7f);
+	while (i + 16 <= n)
+	{
+		__m128i a = _mm_loadu_si128((__m128i const *)(str + i));
+		__m128i b = _mm_loadu_si128((__m128i const *)(str + i + 4));
+		__m128i c = _mm_loadu_si128((__m128i const *)(str + i + 8));
+		__m128i d = _mm_loadu_si128((__m128i const *)(str + i + 12));
+		
+		__m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+		any = _mm_and_si128(any, hi_mask);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(any, zero)) != 0xffff)
+			break;
+		
+		__m128i ab = _mm_packs_epi32(a, b);
+		__m128i cd = _mm_packs_epi32(c, d);
+		_mm_storeu_si128((__m128i *)(out_bytes + i), _mm_packus_epi16(ab, cd));
+		i += 16;
+	}
+#endif
+	
+	while (i < n && str[i] < 0x80)
+	{
+		out_bytes[i] = str[i];
+		++i;
+	}
+	
+	return i;
+}
+
+static int
+seq_valid(uint8_t const *bytes, size_t n)
+{
+	// returns the length of the sequence at the start of `bytes`, or 0 if
+	// it is invalid or truncated.
+	// the accepted ranges for the second byte follow the table in RFC
+	// 3629, which rules out overlong encodings, surrogates, and codepoints
+	// past U+10FFFF.
+	int len = utf8_seq_len(bytes[0]);
+	if (len == 1)
+		return 1;
+	
+	uint8_t lo = 0x80, hi = 0xbf;
+	switch (bytes[0])
+	{
+	case 0xe0:
+		lo = 0xa0;
+		break;
+	case 0xed:
+		hi = 0x9f;
+		break;
+	case 0xf0:
+		lo = 0x90;
+		break;
+	case 0xf4:
+		hi = 0x8f;
+		break;
+	}
+	
+	if (!len || (size_t)len > n || bytes[1] < lo || bytes[1] > hi)
+		return 0;
+	
+	for (int i = 2; i < len; ++i)
+	{
+		if ((bytes[i] & 0xc0) != 0x80)
+			return 0;
+	}
+	
+	return len;
 }
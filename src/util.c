@@ -1,6 +1,7 @@
 #include "util.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -102,3 +103,78 @@ is_path_same(char const *pa, char const *pb)
 		return false;
 	return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
 }
+
+char *
+side_path(char const *path, char const *suffix)
+{
+	// files kept alongside another are hidden, and named after its
+	// resolved path so that every way of referring to it gives the same
+	// result.
+	char *real = realpath(path, NULL);
+	char const *full = real ? real : path;
+	
+	char const *name = strrchr(full, '/');
+	size_t dir_len = name ? name - full + 1 : 0;
+	name = name ? name + 1 : full;
+	
+	char *side = malloc(strlen(full) + strlen(suffix) + 2);
+	memcpy(side, full, dir_len);
+	side[dir_len] = '.';
+	strcpy(side + dir_len + 1, name);
+	strcat(side, suffix);
+	
+	free(real);
+	
+	return side;
+}
+
+int
+write_all(int fd, uint8_t const *bytes, size_t n)
+{
+	while (n > 0)
+	{
+		ssize_t nwrite = write(fd, bytes, n);
+		if (nwrite < 0 && errno == EINTR)
+			continue;
+		else if (nwrite <= 0)
+			return 1;
+		
+		bytes += nwrite;
+		n -= nwrite;
+	}
+	
+	return 0;
+}
+
+uint8_t *
+put_varint(uint8_t *bytes, uint64_t v)
+{
+	// values are stored seven bits at a time, lowest first, with the top
+	// bit of every byte but the last set.
+	while (v >= 0x80)
+	{
+		*bytes++ = 0x80 | (v & 0x7f);
+		v >>= 7;
+	}
+	*bytes++ = v;
+	
+	return bytes;
+}
+
+int
+get_varint(uint8_t const **bytes, uint8_t const *end, uint64_t *out_v)
+{
+	uint64_t v = 0;
+	for (unsigned shift = 0; *bytes < end && shift < 64; shift += 7)
+	{
+		uint8_t byte = *(*bytes)++;
+		v |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+		{
+			*out_v = v;
+			return 0;
+		}
+	}
+	
+	return 1;
+}